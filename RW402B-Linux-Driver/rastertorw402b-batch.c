@@ -0,0 +1,735 @@
+/******************************************************************************
+ *
+ * Munbyn RW402B CUPS Raster Filter - batch converter
+ *
+ * Converts many pre-rendered labels to TSPL without going through CUPS.
+ * Inputs are files, directories of files or stdin, each holding CUPS or PWG
+ * raster, or binary PGM/PBM images, several of which may be concatenated.
+ * Labels are dithered in parallel on a pool of worker threads and written
+ * in input order to one TSPL stream, or dealt round robin to one stream per
+ * printer. The filter's page options apply, CollapseDuplicates, FormCache
+ * and DifferentialUpdate included, each printer keeping its own state.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#define RW402B_NO_MAIN
+#include "rastertorw402b.c"
+
+#include <dirent.h>
+
+// Labels read ahead per worker thread before a batch is converted
+#define BATCH_LABELS_PER_THREAD 4
+
+// Most output streams, one per printer
+#define BATCH_MAX_PRINTERS 64
+
+// One label as read, and once converted
+typedef struct batch_label_s
+{
+    unsigned char *pixels; // 8-bit gray, or the packed lines of a bilevel label
+    size_t pixels_size;
+    int width;
+    int height;
+    int bytes_per_line; // Of 'pixels'
+    int bilevel;
+    int invert; // Bilevel input with set bits meaning black
+    unsigned resolution[2]; // Dots per inch the label was rendered at
+    int scaled; // Gray downscaled to PRINTER_DPI before dithering
+    unsigned char *mono; // Packed label after dithering, mirror and rotation
+    size_t mono_size;
+    int mono_width;
+    int mono_height;
+} batch_label_t;
+
+// Labels converted together, then written in order
+typedef struct batch_s
+{
+    batch_label_t *labels;
+    int capacity;
+    int count;
+    atomic_int next; // Next label for a worker to take
+    print_job_config_t *config;
+} batch_t;
+
+// Each worker keeps its own dither state and scratch buffers from batch to
+// batch
+typedef struct batch_worker_s
+{
+    batch_t *batch;
+    buffer_pool_t pool;
+    pthread_t thread;
+} batch_worker_t;
+
+// Where labels come from: the input of one file or of stdin
+typedef struct batch_source_s
+{
+    raster_input_t input;
+    cups_raster_t *raster; // Set once the rest of the input is raster
+    const char *name;
+} batch_source_t;
+
+// Function Prototypes
+int batch_read_label(batch_source_t *source, batch_label_t *label);
+void batch_convert(batch_t *batch, batch_worker_t *workers, int threads);
+void batch_convert_label(batch_label_t *label, print_job_config_t *config, buffer_pool_t *pool);
+int batch_write(batch_t *batch, print_job_config_t *config);
+int batch_finish(print_job_config_t *config);
+int batch_run_source(batch_source_t *source, batch_t *batch, batch_worker_t *workers, int threads,
+                     print_job_config_t *config);
+int batch_run_path(const char *path, batch_t *batch, batch_worker_t *workers, int threads, print_job_config_t *config);
+
+// Output streams and what each printer has already been sent
+static int batch_printers = 1;
+static int batch_fds[BATCH_MAX_PRINTERS];
+static tspl_state_t batch_sent[BATCH_MAX_PRINTERS];
+static retained_page_t batch_retained[BATCH_MAX_PRINTERS]; // For DifferentialUpdate
+static pending_page_t batch_pending[BATCH_MAX_PRINTERS];   // For CollapseDuplicates
+static buffer_pool_t batch_pools[BATCH_MAX_PRINTERS];      // Holds the pending label
+static form_cache_t batch_forms[BATCH_MAX_PRINTERS];       // For FormCache
+static int batch_page_mm[BATCH_MAX_PRINTERS][2];           // Size of the last label sent to each printer
+static long batch_labels_written;
+static int batch_dpi = 203;
+static int batch_page_size_set; // PageSize was given, labels are not measured
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: rastertorw402b-batch [-j threads] [-p printers] [-o output] [-r dpi] [-c copies] [-O options]\n"
+            "                            [input ...]\n"
+            "Inputs are CUPS/PWG raster or PGM/PBM files, directories of them, or - for stdin (the default).\n"
+            "With -p, outputs are named <output>-1.tspl, <output>-2.tspl and so on.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *output = NULL;
+    const char *option_string = "";
+    int copies = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:p:o:r:c:O:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'p':
+            batch_printers = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'r':
+            batch_dpi = atoi(optarg);
+            break;
+        case 'c':
+            copies = atoi(optarg);
+            break;
+        case 'O':
+            option_string = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    if (batch_printers < 1 || batch_printers > BATCH_MAX_PRINTERS || batch_dpi <= 0 || (batch_printers > 1 && !output))
+    {
+        usage();
+        return 1;
+    }
+
+    pack_init();
+
+    print_job_config_t config = {0};
+    config.user = getenv("USER") ? getenv("USER") : "batch";
+    config.title = "batch";
+    config.copies = copies;
+    set_default_options(&config);
+
+    cups_option_t *options = NULL;
+    int num_options = cupsParseOptions(option_string, 0, &options);
+    set_pstops_options(&config, num_options, options, NULL);
+    batch_page_size_set = cupsGetOption("PageSize", num_options, options) != NULL;
+
+    // Labels are spread over the threads, each label is dithered serially
+    config.dither_threads = 0;
+
+    for (int i = 0; i < batch_printers; ++i)
+    {
+        if (!output)
+        {
+            batch_fds[i] = STDOUT_FILENO;
+            if (config.form_cache)
+                form_cache_load(batch_forms + i, "batch");
+            continue;
+        }
+
+        char path[1024];
+        if (batch_printers == 1)
+            snprintf(path, sizeof(path), "%s", output);
+        else
+            snprintf(path, sizeof(path), "%s-%d.tspl", output, i + 1);
+        batch_fds[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (batch_fds[i] < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to create %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+
+        // Each output is its own printer, with forms indexed by file name
+        if (config.form_cache)
+        {
+            const char *name = strrchr(path, '/');
+            form_cache_load(batch_forms + i, name ? name + 1 : path);
+        }
+    }
+
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.capacity = threads * BATCH_LABELS_PER_THREAD;
+    batch.labels = calloc(batch.capacity, sizeof(batch_label_t));
+    batch_worker_t *workers = calloc(threads, sizeof(batch_worker_t));
+    if (!batch.labels || !workers)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for the batch.\n");
+        return 1;
+    }
+    batch.config = &config;
+
+    double start = stage_clock();
+    int failed = 0;
+    if (optind == argc)
+        failed |= batch_run_path("-", &batch, workers, threads, &config);
+    for (int i = optind; i < argc; ++i)
+    {
+        failed |= batch_run_path(argv[i], &batch, workers, threads, &config);
+    }
+
+    // Whatever is left over from the last full batch
+    batch_convert(&batch, workers, threads);
+    failed |= batch_write(&batch, &config);
+    failed |= batch_finish(&config);
+    double seconds = stage_clock() - start;
+
+    fprintf(stderr, "%ld labels in %.2f s, %.1f labels/s, %d thread%s, %d output%s\n", batch_labels_written, seconds,
+            seconds > 0 ? batch_labels_written / seconds : 0.0, threads, threads == 1 ? "" : "s", batch_printers,
+            batch_printers == 1 ? "" : "s");
+
+    for (int i = 0; i < batch_printers; ++i)
+    {
+        if (batch_fds[i] != STDOUT_FILENO)
+            close(batch_fds[i]);
+        retained_page_free(batch_retained + i);
+        pool_free(batch_pools + i);
+    }
+    for (int i = 0; i < threads; ++i)
+    {
+        pool_free(&workers[i].pool);
+    }
+    for (int i = 0; i < batch.capacity; ++i)
+    {
+        free(batch.labels[i].pixels);
+        free(batch.labels[i].mono);
+    }
+    free(batch.labels);
+    free(workers);
+    cupsFreeOptions(num_options, options);
+    return failed ? 1 : 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Convert everything in 'path': stdin for "-", each regular file of a
+// directory in name order, or the file itself
+int batch_run_path(const char *path, batch_t *batch, batch_worker_t *workers, int threads, print_job_config_t *config)
+{
+    batch_source_t source;
+    source.name = path;
+
+    if (strcmp(path, "-") == 0)
+    {
+        if (raster_input_open(&source.input, 0) < 0)
+            return 1;
+        return batch_run_source(&source, batch, workers, threads, config);
+    }
+
+    struct stat info;
+    if (stat(path, &info) < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to read %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if (S_ISDIR(info.st_mode))
+    {
+        DIR *dir = opendir(path);
+        if (!dir)
+        {
+            fprintf(stderr, "ERROR: Unable to read %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+
+        // Sort the names, so the output order does not depend on the file system
+        char **names = NULL;
+        int count = 0;
+        int allocated = 0;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            if (count == allocated)
+            {
+                allocated = allocated ? allocated * 2 : 256;
+                char **grown = realloc(names, allocated * sizeof(char *));
+                if (!grown)
+                    break;
+                names = grown;
+            }
+            names[count++] = strdup(entry->d_name);
+        }
+        closedir(dir);
+        qsort(names, count, sizeof(char *), compare_names);
+
+        int failed = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+            if (stat(child, &info) == 0 && S_ISREG(info.st_mode))
+                failed |= batch_run_path(child, batch, workers, threads, config);
+            free(names[i]);
+        }
+        free(names);
+        return failed;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int failed = 1;
+    if (raster_input_open(&source.input, fd) == 0)
+        failed = batch_run_source(&source, batch, workers, threads, config);
+    close(fd);
+    return failed;
+}
+
+// Read every label of 'source' into the batch, converting and writing each
+// time it fills up
+int batch_run_source(batch_source_t *source, batch_t *batch, batch_worker_t *workers, int threads,
+                     print_job_config_t *config)
+{
+    int failed = 0;
+    int result;
+    source->raster = NULL;
+
+    for (;;)
+    {
+        if (batch->count == batch->capacity)
+        {
+            batch_convert(batch, workers, threads);
+            failed |= batch_write(batch, config);
+        }
+
+        result = batch_read_label(source, batch->labels + batch->count);
+        if (result <= 0)
+            break;
+        batch->count++;
+    }
+
+    if (source->raster)
+        cupsRasterClose(source->raster);
+    raster_input_close(&source->input);
+    return failed || result < 0;
+}
+
+// Skip the whitespace and comments of a PNM header, then read a number
+static int read_pnm_number(raster_input_t *input, int *value)
+{
+    unsigned char c;
+    do
+    {
+        if (raster_input_read(input, &c, 1) != 1)
+            return -1;
+        if (c == '#')
+        {
+            while (c != '\n')
+            {
+                if (raster_input_read(input, &c, 1) != 1)
+                    return -1;
+            }
+        }
+    } while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+
+    *value = 0;
+    while (c >= '0' && c <= '9')
+    {
+        if (*value > 100000)
+            return -1;
+        *value = *value * 10 + (c - '0');
+        // The single whitespace after the last number ends the header
+        if (raster_input_read(input, &c, 1) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+static int read_exactly(raster_input_t *input, unsigned char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t got = raster_input_read(input, buffer, length);
+        if (got <= 0)
+            return -1;
+        buffer += got;
+        length -= got;
+    }
+    return 0;
+}
+
+static int grow_buffer(unsigned char **buffer, size_t *size, size_t needed)
+{
+    if (*size >= needed)
+        return 0;
+    unsigned char *grown = realloc(*buffer, needed);
+    if (!grown)
+        return -1;
+    *buffer = grown;
+    *size = needed;
+    return 0;
+}
+
+// Read the next label of 'source'. Returns 1 for a label, 0 at the end and
+// -1 on an error, which also ends the source.
+int batch_read_label(batch_source_t *source, batch_label_t *label)
+{
+    if (!source->raster)
+    {
+        // Concatenated images may be separated by whitespace
+        unsigned char magic[4];
+        size_t got;
+        while ((got = raster_input_peek(&source->input, magic, 1)) == 1 &&
+               (magic[0] == ' ' || magic[0] == '\t' || magic[0] == '\r' || magic[0] == '\n'))
+        {
+            raster_input_read(&source->input, magic, 1);
+        }
+        if (got == 0)
+            return 0;
+
+        got = raster_input_peek(&source->input, magic, sizeof(magic));
+        if (got >= 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '4'))
+        {
+            int width, height, maxval = 1;
+            raster_input_read(&source->input, magic, 2);
+            if (read_pnm_number(&source->input, &width) < 0 || read_pnm_number(&source->input, &height) < 0 ||
+                (magic[1] == '5' && read_pnm_number(&source->input, &maxval) < 0) || width <= 0 || height <= 0 ||
+                maxval <= 0 || maxval > 255)
+            {
+                fprintf(stderr, "ERROR: %s: unsupported or damaged PNM header.\n", source->name);
+                return -1;
+            }
+
+            label->width = width;
+            label->height = height;
+            label->bilevel = magic[1] == '4';
+            label->invert = 1; // PBM sets bits for black
+            label->resolution[0] = label->resolution[1] = batch_dpi;
+            label->bytes_per_line = label->bilevel ? (width + 7) / 8 : width;
+            size_t size = (size_t)label->bytes_per_line * height;
+            if (grow_buffer(&label->pixels, &label->pixels_size, size) < 0 ||
+                read_exactly(&source->input, label->pixels, size) < 0)
+            {
+                fprintf(stderr, "ERROR: %s: image data is short.\n", source->name);
+                return -1;
+            }
+            if (maxval != 255 && !label->bilevel)
+            {
+                for (size_t i = 0; i < size; ++i)
+                {
+                    label->pixels[i] = (unsigned char)(label->pixels[i] > maxval ? 255 : label->pixels[i] * 255 / maxval);
+                }
+            }
+            return 1;
+        }
+
+        // Anything else has to be a raster stream, which runs to the end
+        source->raster = cupsRasterOpenIO(raster_input_read, &source->input, CUPS_RASTER_READ);
+        if (!source->raster)
+        {
+            fprintf(stderr, "ERROR: %s: not a raster stream or PNM image.\n", source->name);
+            return -1;
+        }
+    }
+
+    cups_page_header2_t header;
+    for (;;)
+    {
+        if (!cupsRasterReadHeader2(source->raster, &header))
+            return 0;
+        if (header.cupsWidth == 0 || header.cupsHeight == 0 || header.cupsBytesPerLine == 0)
+            continue;
+
+        size_t size = (size_t)header.cupsBytesPerLine * header.cupsHeight;
+        if (grow_buffer(&label->pixels, &label->pixels_size, size) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for raster page.\n");
+            return -1;
+        }
+        if (cupsRasterReadPixels(source->raster, label->pixels, size) == 0)
+        {
+            fprintf(stderr, "ERROR: %s: failed to read raster pixels.\n", source->name);
+            return -1;
+        }
+
+        if (!raster_is_supported(&header))
+        {
+            fprintf(stderr, "ERROR: %s: skipping a page with %u bits per pixel in color space %d.\n", source->name,
+                    header.cupsBitsPerPixel, header.cupsColorSpace);
+            continue;
+        }
+        int bilevel = raster_is_bilevel(&header);
+
+        label->width = header.cupsWidth;
+        label->height = header.cupsHeight;
+        label->bilevel = bilevel;
+        label->invert = header.cupsColorSpace == CUPS_CSPACE_K;
+        label->resolution[0] = header.HWResolution[0];
+        label->resolution[1] = header.HWResolution[1];
+        label->bytes_per_line = header.cupsBytesPerLine;
+
+        if (!bilevel)
+        {
+            raster_to_gray(&header, label->pixels, label->height);
+            label->bytes_per_line = label->width;
+        }
+        return 1;
+    }
+}
+
+static void *batch_worker(void *arg)
+{
+    batch_worker_t *worker = arg;
+    batch_t *batch = worker->batch;
+
+    int i;
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count)
+    {
+        batch_convert_label(batch->labels + i, batch->config, &worker->pool);
+    }
+    return NULL;
+}
+
+// Convert every label read into the batch, spread over the worker threads
+void batch_convert(batch_t *batch, batch_worker_t *workers, int threads)
+{
+    if (batch->count == 0)
+        return;
+    if (threads > batch->count)
+        threads = batch->count;
+    atomic_store(&batch->next, 0);
+
+    int started = 0;
+    for (int i = 1; i < threads; ++i)
+    {
+        workers[i].batch = batch;
+        if (pthread_create(&workers[i].thread, NULL, batch_worker, workers + i) != 0)
+            break;
+        started++;
+    }
+
+    // This thread works too, and picks up anything a failed start left
+    workers[0].batch = batch;
+    batch_worker(workers);
+
+    for (int i = 1; i <= started; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
+
+// Dither, mirror and rotate one label, as the filter does with a page
+void batch_convert_label(batch_label_t *label, print_job_config_t *config, buffer_pool_t *pool)
+{
+    label->mono_width = 0;
+
+    // Gray rendered finer than the print head is averaged down first
+    unsigned scaled_width, scaled_height;
+    label->scaled = !label->bilevel &&
+                    downscale_size(label->width, label->height, label->resolution, &scaled_width, &scaled_height);
+    if (label->scaled)
+    {
+        if (downscale_page(label->pixels, label->width, label->height, scaled_width, scaled_height) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for downscaling.\n");
+            return;
+        }
+        label->width = scaled_width;
+        label->height = scaled_height;
+        label->bytes_per_line = scaled_width;
+    }
+
+    int width = label->width;
+    int height = label->height;
+    int width_bytes = (width + 7) / 8;
+    size_t mono_size = (size_t)width_bytes * height;
+    int rotate = config->rotate == 1 || config->rotate == 2 || config->rotate == 3;
+
+    unsigned char *mono = rotate ? pool_get(pool, POOL_MONO, mono_size) : NULL;
+    if (!rotate && grow_buffer(&label->mono, &label->mono_size, mono_size) == 0)
+        mono = label->mono;
+    if (!mono)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for monochrome buffer.\n");
+        return;
+    }
+
+    if (label->bilevel)
+    {
+        copy_bilevel_rows(label->pixels, label->bytes_per_line, mono, width, height,
+                          label->invert != (config->negativeImage != 0));
+    }
+    else
+    {
+        dither_state_t *dither = pool_dither(pool, width, config->print_mode, 0);
+        if (!dither)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for dithering.\n");
+            return;
+        }
+        dither_set_tone(dither, config);
+        dither_rows(dither, label->pixels, mono, height);
+    }
+    apply_image_manipulations(mono, width, height, config);
+
+    if (rotate)
+    {
+        size_t rotated_size = config->rotate == 1 ? mono_size : ((size_t)height + 7) / 8 * width;
+        if (grow_buffer(&label->mono, &label->mono_size, rotated_size) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for rotation.\n");
+            return;
+        }
+        rotate_mono(mono, label->mono, width, height, config->rotate);
+        if (config->rotate != 1)
+        {
+            int rotated_width = height;
+            height = width;
+            width = rotated_width;
+        }
+    }
+
+    label->mono_width = width;
+    label->mono_height = height;
+}
+
+// Switch the output and the per-printer state of 'config' to 'printer'
+static void batch_use_printer(int printer, print_job_config_t *config)
+{
+    output_set_fd(batch_fds[printer]);
+    config->sent = batch_sent[printer];
+    config->retained = batch_retained[printer];
+    config->forms = config->form_cache ? batch_forms + printer : NULL;
+    if (!batch_page_size_set)
+    {
+        config->page_width_mm = batch_page_mm[printer][0];
+        config->page_height_mm = batch_page_mm[printer][1];
+    }
+}
+
+static void batch_leave_printer(int printer, const print_job_config_t *config)
+{
+    batch_sent[printer] = config->sent;
+    batch_retained[printer] = config->retained;
+}
+
+// Write the converted labels in order, dealing them to the printers in turn
+int batch_write(batch_t *batch, print_job_config_t *config)
+{
+    int failed = 0;
+    for (int i = 0; i < batch->count; ++i)
+    {
+        batch_label_t *label = batch->labels + i;
+        if (label->mono_width == 0)
+        {
+            failed = 1;
+            continue;
+        }
+
+        int printer = (int)(batch_labels_written % batch_printers);
+        batch_use_printer(printer, config);
+
+        // Without a PageSize the label is as large as the image. A label held
+        // back as a possible duplicate goes out first, at its own size.
+        if (!batch_page_size_set)
+        {
+            int dpi = label->scaled ? PRINTER_DPI : batch_dpi;
+            int width_mm = (int)(label->mono_width * 25.4 / dpi + 0.5);
+            int height_mm = (int)(label->mono_height * 25.4 / dpi + 0.5);
+            if (width_mm != config->page_width_mm || height_mm != config->page_height_mm)
+            {
+                flush_pending_page(batch_pending + printer, config);
+                config->page_width_mm = batch_page_mm[printer][0] = width_mm;
+                config->page_height_mm = batch_page_mm[printer][1] = height_mm;
+            }
+        }
+
+        // The label moves into the printer's pool, where duplicate detection
+        // can keep it, and takes whatever buffer was there in exchange
+        buffer_pool_t *pool = batch_pools + printer;
+        swap_buffers(&label->mono, &label->mono_size, &pool->buffers[POOL_MONO], &pool->sizes[POOL_MONO]);
+        mono_page_t page;
+        page.data = pool->buffers[POOL_MONO];
+        page.width_bytes = (label->mono_width + 7) / 8;
+        page.height = label->mono_height;
+        page.size = (size_t)page.width_bytes * page.height;
+        write_mono_page(&page, batch_pending + printer, config, pool);
+        if (output_flush() < 0)
+            failed = 1;
+        batch_leave_printer(printer, config);
+        batch_labels_written++;
+    }
+
+    batch->count = 0;
+    return failed;
+}
+
+// Send the label each printer still holds back and write its form index
+int batch_finish(print_job_config_t *config)
+{
+    int failed = 0;
+    for (int printer = 0; printer < batch_printers; ++printer)
+    {
+        batch_use_printer(printer, config);
+        flush_pending_page(batch_pending + printer, config);
+        if (output_flush() < 0)
+            failed = 1;
+        batch_leave_printer(printer, config);
+        if (config->forms)
+            form_cache_close(config->forms);
+    }
+    config->forms = NULL;
+    return failed;
+}
@@ -0,0 +1,583 @@
+/******************************************************************************
+ *
+ * Munbyn RW402B CUPS Raster Filter - stage benchmark
+ *
+ * Times each stage of the filter on synthetic pages of the sizes in the PPD
+ * and reports ns/pixel, MB/s and the peak RSS of the process. The pages are
+ * also written as CUPS raster streams, so reading, color conversion and
+ * downscaling are timed through libcups as the filter runs them.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#define RW402B_NO_MAIN
+#include "rastertorw402b.c"
+
+#include <sys/resource.h>
+
+// Page sizes from the PPD, in points
+typedef struct bench_size_s
+{
+    const char *name;
+    int width_pt;
+    int height_pt;
+} bench_size_t;
+
+static const bench_size_t bench_sizes[] = {
+    {"w114h85", 114, 85},
+    {"w142h85", 142, 85},
+    {"w142h142", 142, 142},
+    {"w144h72", 144, 72},
+    {"w144h144", 144, 144},
+    {"w164h164", 164, 164},
+    {"w162h162", 162, 162},
+    {"w162h90", 162, 90},
+    {"w180h108", 180, 108},
+    {"w216h144", 216, 144},
+    {"w216h216", 216, 216},
+    {"w216h360", 216, 360},
+    {"w288h432", 288, 432},
+};
+
+// Sizes run when none are named on the command line
+static const char *bench_default_sizes[] = {"w144h72", "w216h144", "w288h432"};
+
+enum bench_content_e
+{
+    CONTENT_GRADIENT = 0,
+    CONTENT_TEXT,
+    CONTENT_BARCODE,
+    CONTENT_COUNT
+};
+
+static const char *bench_content_names[CONTENT_COUNT] = {"gradient", "text", "barcode"};
+
+// What a stage starts from: the gray page, the packed page or one of the
+// raster streams of the page
+enum bench_input_e
+{
+    INPUT_GRAY = 0,
+    INPUT_PACKED,
+    INPUT_STREAM_GRAY, // 8-bit gray, as Ghostscript renders for the PPD
+    INPUT_STREAM_RGB,  // sRGB, as driverless clients send
+    INPUT_STREAM_FINE, // 8-bit gray at BENCH_FINE_SCALE times the resolution
+    INPUT_COUNT
+};
+
+#define BENCH_STREAM_COUNT (INPUT_COUNT - INPUT_STREAM_GRAY)
+
+// Applications that render at whatever the PPD says send raster this much
+// finer than the print head
+#define BENCH_FINE_SCALE 3
+
+// One page as a CUPS raster stream in a temporary file, mapped for reading
+// the way the filter maps a job file
+typedef struct bench_stream_s
+{
+    FILE *file;
+    raster_input_t input;
+    cups_page_header2_t header;
+} bench_stream_t;
+
+// A page and the buffers the stages work in
+typedef struct bench_page_s
+{
+    int width;
+    int height;
+    int width_bytes;
+    unsigned char *gray;
+    unsigned char *mono;
+    unsigned char *scratch; // Rotated page
+    unsigned char *raster;  // Pixels read back from a stream
+    bench_stream_t streams[BENCH_STREAM_COUNT];
+    int dpi;
+    print_job_config_t config;
+} bench_page_t;
+
+typedef void (*bench_stage_fn)(bench_page_t *page);
+
+// Seconds each stage runs for, at least
+static double bench_min_time = 0.25;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Small deterministic generator, so every run draws the same pages
+static unsigned bench_random(unsigned *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+static void fill_rect(bench_page_t *page, int x0, int y0, int w, int h, unsigned char value)
+{
+    for (int y = y0; y < y0 + h && y < page->height; ++y)
+    {
+        for (int x = x0; x < x0 + w && x < page->width; ++x)
+        {
+            page->gray[(size_t)y * page->width + x] = value;
+        }
+    }
+}
+
+// Draw the page content into page->gray
+static void generate_page(bench_page_t *page, int content)
+{
+    int width = page->width;
+    int height = page->height;
+    unsigned seed = 1;
+
+    switch (content)
+    {
+    case CONTENT_GRADIENT:
+        // Diagonal ramp, every gray level on every line
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                page->gray[(size_t)y * width + x] = (unsigned char)((x * 255 / width + y * 255 / height) / 2);
+            }
+        }
+        break;
+
+    case CONTENT_TEXT:
+        // Lines of glyph-sized clusters of strokes on white
+        memset(page->gray, 255, (size_t)width * height);
+        for (int y = 8; y + 24 < height; y += 32)
+        {
+            for (int x = 8; x + 14 < width; x += 16)
+            {
+                if (bench_random(&seed) % 8 == 0)
+                    continue;
+                int strokes = 2 + bench_random(&seed) % 3;
+                for (int i = 0; i < strokes; ++i)
+                {
+                    if (bench_random(&seed) & 1)
+                        fill_rect(page, x + bench_random(&seed) % 10, y, 3, 24, 0);
+                    else
+                        fill_rect(page, x, y + bench_random(&seed) % 21, 12, 3, 0);
+                }
+            }
+        }
+        break;
+
+    case CONTENT_BARCODE:
+        // Bars 2 to 8 dots wide over the middle of the page, a text line below
+        memset(page->gray, 255, (size_t)width * height);
+        for (int x = width / 10; x < width - width / 10;)
+        {
+            int bar = 2 * (1 + bench_random(&seed) % 4);
+            int space = 2 * (1 + bench_random(&seed) % 4);
+            fill_rect(page, x, height / 5, bar, height * 3 / 5, 0);
+            x += bar + space;
+        }
+        for (int x = width / 10; x + 14 < width - width / 10; x += 16)
+        {
+            fill_rect(page, x, height * 17 / 20, 3, height / 10, 0);
+            fill_rect(page, x, height * 17 / 20, 12, 3, 0);
+        }
+        break;
+    }
+}
+
+// Raster streams -------------------------------------------------------------
+
+static ssize_t bench_write_raster(void *ctx, unsigned char *buffer, size_t length)
+{
+    return write(*(int *)ctx, buffer, length);
+}
+
+// Write page->gray to a compressed raster stream, 'scale' times finer and in
+// RGB when asked, and map it for reading
+static int bench_write_stream(bench_page_t *page, bench_stream_t *stream, int rgb, int scale)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->file = tmpfile();
+    if (!stream->file)
+        return -1;
+    int fd = fileno(stream->file);
+
+    cups_page_header2_t *header = &stream->header;
+    header->HWResolution[0] = header->HWResolution[1] = page->dpi * scale;
+    header->cupsWidth = page->width * scale;
+    header->cupsHeight = page->height * scale;
+    header->cupsBitsPerColor = 8;
+    header->cupsBitsPerPixel = rgb ? 24 : 8;
+    header->cupsBytesPerLine = header->cupsWidth * (rgb ? 3 : 1);
+    header->cupsColorSpace = rgb ? CUPS_CSPACE_SRGB : CUPS_CSPACE_W;
+
+    cups_raster_t *raster = cupsRasterOpenIO(bench_write_raster, &fd, CUPS_RASTER_WRITE_COMPRESSED);
+    unsigned char *line = malloc(header->cupsBytesPerLine);
+    int ok = raster && line && cupsRasterWriteHeader2(raster, header);
+    for (unsigned y = 0; ok && y < header->cupsHeight; ++y)
+    {
+        const unsigned char *gray = page->gray + (size_t)(y / scale) * page->width;
+        for (unsigned x = 0; x < header->cupsWidth; ++x)
+        {
+            if (rgb)
+                line[3 * x] = line[3 * x + 1] = line[3 * x + 2] = gray[x / scale];
+            else
+                line[x] = gray[x / scale];
+        }
+        ok = cupsRasterWritePixels(raster, line, header->cupsBytesPerLine) == header->cupsBytesPerLine;
+    }
+    free(line);
+    if (raster)
+        cupsRasterClose(raster);
+
+    if (!ok || raster_input_open(&stream->input, fd) < 0 || !stream->input.map)
+    {
+        fprintf(stderr, "ERROR: Unable to write a raster stream.\n");
+        raster_input_close(&stream->input);
+        fclose(stream->file);
+        stream->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_free_stream(bench_stream_t *stream)
+{
+    if (!stream->file)
+        return;
+    raster_input_close(&stream->input);
+    fclose(stream->file);
+    stream->file = NULL;
+}
+
+// Read the page of 'stream' into page->raster with libcups, from the start
+// of the mapped file as a job file would be read
+static int bench_read_stream(bench_page_t *page, bench_stream_t *stream)
+{
+    stream->input.position = 0;
+    cups_raster_t *raster = cupsRasterOpenIO(raster_input_read, &stream->input, CUPS_RASTER_READ);
+    cups_page_header2_t header;
+    unsigned size = stream->header.cupsBytesPerLine * stream->header.cupsHeight;
+    int ok = raster && cupsRasterReadHeader2(raster, &header) && cupsRasterReadPixels(raster, page->raster, size) == size;
+    if (raster)
+        cupsRasterClose(raster);
+    if (!ok)
+        fprintf(stderr, "ERROR: Unable to read back a raster stream.\n");
+    return ok ? 0 : -1;
+}
+
+// Stages ---------------------------------------------------------------------
+
+static void stage_raster_read(bench_page_t *page)
+{
+    bench_read_stream(page, page->streams + INPUT_STREAM_GRAY - INPUT_STREAM_GRAY);
+}
+
+static void stage_raster_rgb(bench_page_t *page)
+{
+    bench_stream_t *stream = page->streams + INPUT_STREAM_RGB - INPUT_STREAM_GRAY;
+    if (bench_read_stream(page, stream) == 0)
+        raster_to_gray(&stream->header, page->raster, stream->header.cupsHeight);
+}
+
+static void stage_raster_downscale(bench_page_t *page)
+{
+    bench_stream_t *stream = page->streams + INPUT_STREAM_FINE - INPUT_STREAM_GRAY;
+    unsigned width, height;
+    if (bench_read_stream(page, stream) == 0 &&
+        downscale_size(stream->header.cupsWidth, stream->header.cupsHeight, stream->header.HWResolution, &width, &height))
+        downscale_page(page->raster, stream->header.cupsWidth, stream->header.cupsHeight, width, height);
+}
+
+static void stage_dither_default(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_DEFAULT, 0);
+}
+
+static void stage_dither_threaded(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_DEFAULT, 4);
+}
+
+static void stage_threshold(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_NONE, 0);
+}
+
+static void stage_bayer(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_BAYER, 0);
+}
+
+static void stage_blue_noise(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_BLUE_NOISE, 0);
+}
+
+static void stage_serpentine(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_SERPENTINE, 0);
+}
+
+static void stage_atkinson(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_ATKINSON, 0);
+}
+
+static void stage_stucki(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_STUCKI, 0);
+}
+
+static void stage_sierra_lite(bench_page_t *page)
+{
+    convert_gray_to_mono(page->gray, page->mono, page->width, page->height, PRINT_MODE_SIERRA_LITE, 0);
+}
+
+// The diffusion loop alone, without the state setup in convert_gray_to_mono
+static void stage_error_diffusion(bench_page_t *page)
+{
+    static dither_state_t state;
+    static int state_width;
+    if (state_width != page->width)
+    {
+        if (state_width)
+            dither_free(&state);
+        state_width = dither_init(&state, page->width, PRINT_MODE_DEFAULT, 0) == 0 ? page->width : 0;
+    }
+    if (!state_width)
+        return;
+
+    dither_restart(&state);
+    error_diffusion(&state, page->gray, page->mono, page->height);
+}
+
+static void stage_mirror(bench_page_t *page)
+{
+    page->config.mirrorImage = 1;
+    apply_image_manipulations(page->mono, page->width, page->height, &page->config);
+    page->config.mirrorImage = 0;
+}
+
+static void stage_rotate(bench_page_t *page)
+{
+    rotate_mono(page->mono, page->scratch, page->width, page->height, 2);
+}
+
+static void stage_tspl_bitmap(bench_page_t *page)
+{
+    page->config.sparse_bitmap = 0;
+    send_printer_commands(page->mono, page->width_bytes, page->height, 1, &page->config);
+}
+
+static void stage_tspl_sparse(bench_page_t *page)
+{
+    page->config.sparse_bitmap = 1;
+    send_printer_commands(page->mono, page->width_bytes, page->height, 1, &page->config);
+    page->config.sparse_bitmap = 0;
+}
+
+typedef struct bench_stage_s
+{
+    const char *name;
+    bench_stage_fn run;
+    int input; // See bench_input_e
+} bench_stage_t;
+
+// The raster stages include reading the stream, raster-read alone gives the
+// part that is libcups
+static const bench_stage_t bench_stages[] = {
+    {"raster-read", stage_raster_read, INPUT_STREAM_GRAY},
+    {"raster-rgb", stage_raster_rgb, INPUT_STREAM_RGB},
+    {"raster-downscale", stage_raster_downscale, INPUT_STREAM_FINE},
+    {"dither-fs", stage_dither_default, INPUT_GRAY},
+    {"dither-fs-4t", stage_dither_threaded, INPUT_GRAY},
+    {"error_diffusion", stage_error_diffusion, INPUT_GRAY},
+    {"fs-serpentine", stage_serpentine, INPUT_GRAY},
+    {"atkinson", stage_atkinson, INPUT_GRAY},
+    {"stucki", stage_stucki, INPUT_GRAY},
+    {"sierra-lite", stage_sierra_lite, INPUT_GRAY},
+    {"threshold", stage_threshold, INPUT_GRAY},
+    {"bayer", stage_bayer, INPUT_GRAY},
+    {"blue-noise", stage_blue_noise, INPUT_GRAY},
+    {"mirror", stage_mirror, INPUT_PACKED},
+    {"rotate-90", stage_rotate, INPUT_PACKED},
+    {"tspl-bitmap", stage_tspl_bitmap, INPUT_PACKED},
+    {"tspl-sparse", stage_tspl_sparse, INPUT_PACKED},
+};
+
+// Run 'stage' until bench_min_time has passed and print one result line.
+// ns/pixel is per printed pixel, MB/s counts the bytes the stage reads.
+static void run_stage(FILE *report, const char *size_name, int content, const bench_stage_t *stage, bench_page_t *page)
+{
+    // Packed stages start from the dithered page, as in the filter
+    if (stage->input == INPUT_PACKED)
+        stage_dither_default(page);
+
+    long iterations = 0;
+    double start = now_seconds();
+    double elapsed;
+    do
+    {
+        stage->run(page);
+        iterations++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < bench_min_time || iterations < 3);
+
+    double pixels = (double)page->width * page->height * iterations;
+    double bytes = (double)page->width * page->height;
+    if (stage->input == INPUT_PACKED)
+        bytes = (double)page->width_bytes * page->height;
+    else if (stage->input >= INPUT_STREAM_GRAY)
+        bytes = (double)page->streams[stage->input - INPUT_STREAM_GRAY].input.map_length;
+    bytes *= iterations;
+    fprintf(report, "%-10s %-9s %-16s %10.2f %10.1f %10ld\n", size_name, bench_content_names[content], stage->name,
+            elapsed * 1e9 / pixels, bytes / elapsed / 1e6, peak_rss_kb());
+}
+
+static const bench_size_t *find_size(const char *name)
+{
+    for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++i)
+    {
+        if (strcmp(bench_sizes[i].name, name) == 0)
+            return bench_sizes + i;
+    }
+    return NULL;
+}
+
+static int run_size(FILE *report, const bench_size_t *size, int dpi)
+{
+    bench_page_t page;
+    memset(&page, 0, sizeof(page));
+    page.width = size->width_pt * dpi / 72;
+    page.height = size->height_pt * dpi / 72;
+    page.width_bytes = (page.width + 7) / 8;
+    page.dpi = dpi;
+    page.gray = malloc((size_t)page.width * page.height);
+    page.mono = malloc((size_t)page.width_bytes * page.height);
+    page.scratch = malloc((size_t)(page.height + 7) / 8 * page.width);
+    page.raster = malloc((size_t)page.width * page.height * BENCH_FINE_SCALE * BENCH_FINE_SCALE);
+    if (!page.gray || !page.mono || !page.scratch || !page.raster)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for %s.\n", size->name);
+        free(page.gray);
+        free(page.mono);
+        free(page.scratch);
+        free(page.raster);
+        return -1;
+    }
+
+    set_default_options(&page.config);
+    page.config.copies = 1;
+    page.config.page_width_mm = (int)(size->width_pt / 2.835);
+    page.config.page_height_mm = (int)(size->height_pt / 2.835);
+
+    int status = 0;
+    for (int content = 0; content < CONTENT_COUNT && status == 0; ++content)
+    {
+        generate_page(&page, content);
+        if (bench_write_stream(&page, page.streams + INPUT_STREAM_GRAY - INPUT_STREAM_GRAY, 0, 1) < 0 ||
+            bench_write_stream(&page, page.streams + INPUT_STREAM_RGB - INPUT_STREAM_GRAY, 1, 1) < 0 ||
+            bench_write_stream(&page, page.streams + INPUT_STREAM_FINE - INPUT_STREAM_GRAY, 0, BENCH_FINE_SCALE) < 0)
+            status = -1;
+        for (size_t i = 0; i < sizeof(bench_stages) / sizeof(bench_stages[0]) && status == 0; ++i)
+        {
+            run_stage(report, size->name, content, bench_stages + i, &page);
+        }
+        for (int i = 0; i < BENCH_STREAM_COUNT; ++i)
+        {
+            bench_free_stream(page.streams + i);
+        }
+    }
+
+    free(page.gray);
+    free(page.mono);
+    free(page.scratch);
+    free(page.raster);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    int dpi = 203;
+    int first_size = 1;
+
+    for (; first_size < argc && argv[first_size][0] == '-'; ++first_size)
+    {
+        if (strcmp(argv[first_size], "-t") == 0 && first_size + 1 < argc)
+            bench_min_time = atof(argv[++first_size]);
+        else if (strcmp(argv[first_size], "-r") == 0 && first_size + 1 < argc)
+            dpi = atoi(argv[++first_size]);
+        else
+        {
+            fprintf(stderr, "Usage: rastertorw402b-bench [-t seconds] [-r dpi] [all | page-size ...]\n");
+            return 1;
+        }
+    }
+
+    pack_init();
+
+    // The TSPL stages write to stdout like the filter does, so results go to
+    // the original stdout and the printer data goes nowhere
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (!report || null_fd < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to set up output.\n");
+        return 1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    fprintf(report, "%-10s %-9s %-16s %10s %10s %10s\n", "size", "content", "stage", "ns/pixel", "MB/s", "peak-KB");
+
+    int status = 0;
+    if (first_size >= argc)
+    {
+        for (size_t i = 0; i < sizeof(bench_default_sizes) / sizeof(bench_default_sizes[0]); ++i)
+        {
+            status |= run_size(report, find_size(bench_default_sizes[i]), dpi);
+        }
+    }
+    else if (strcmp(argv[first_size], "all") == 0)
+    {
+        for (size_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++i)
+        {
+            status |= run_size(report, bench_sizes + i, dpi);
+        }
+    }
+    else
+    {
+        for (int i = first_size; i < argc; ++i)
+        {
+            const bench_size_t *size = find_size(argv[i]);
+            if (!size)
+            {
+                fprintf(stderr, "ERROR: Unknown page size %s.\n", argv[i]);
+                status = -1;
+                continue;
+            }
+            status |= run_size(report, size, dpi);
+        }
+    }
+
+    fclose(report);
+    return status ? 1 : 0;
+}
@@ -0,0 +1,246 @@
+/******************************************************************************
+ *
+ * Munbyn RW402B CUPS Raster Filter - label server client
+ *
+ * A CUPS filter that hands the job to a running "rastertorw402b --serve"
+ * instead of converting it itself. The job's arguments and raster go to the
+ * server over its Unix socket, and any TSPL the server sends back is copied
+ * to stdout for the backend. The status byte that ends the reply decides
+ * the exit status, so CUPS sees jobs the server could not print as failed.
+ * When no server is listening, the full filter is run in its place, so the
+ * queue keeps printing either way.
+ *
+ * The socket is $RW402B_SOCKET, or /run/rw402b/<printer>.sock.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Must match the server in rastertorw402b.c
+#define LABEL_SERVER_MAGIC "RW402B/2"
+#define LABEL_SERVER_PRINTED 0
+
+// Bytes copied per read in either direction
+#define CLIENT_BLOCK_SIZE (256 * 1024)
+
+// Raster going from the job to the server
+typedef struct client_upload_s
+{
+    int input_fd;
+    int socket_fd;
+    int failed;
+} client_upload_t;
+
+// Function Prototypes
+int connect_label_server(const char *printer_name);
+void *upload_raster(void *arg);
+int write_all(int fd, const void *data, size_t length);
+void run_filter_instead(char *argv[]);
+
+int main(int argc, char *argv[])
+{
+    if (argc < 6 || argc > 7)
+    {
+        fprintf(stderr, "ERROR: rastertorw402b-client job-id user title copies options [file]\n");
+        return 1;
+    }
+
+    const char *printer_name = getenv("PRINTER");
+    int socket_fd = connect_label_server(printer_name);
+    if (socket_fd < 0)
+    {
+        run_filter_instead(argv);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int input_fd = 0; // Default to stdin
+    if (argc == 7)
+    {
+        input_fd = open(argv[6], O_RDONLY);
+        if (input_fd < 0)
+        {
+            perror("ERROR: Unable to open input file");
+            close(socket_fd);
+            return 1;
+        }
+    }
+
+    // The job header: magic, the filter arguments and the printer name, each
+    // ending in a NUL
+    const char *fields[] = {LABEL_SERVER_MAGIC, argv[1], argv[2], argv[3], argv[4], argv[5], printer_name ? printer_name : ""};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+    {
+        if (write_all(socket_fd, fields[i], strlen(fields[i]) + 1) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to send the job to the label server: %s\n", strerror(errno));
+            close(socket_fd);
+            return 1;
+        }
+    }
+
+    // Upload on a second thread while this one copies the reply, so neither
+    // side can stall the other on a full socket buffer
+    client_upload_t upload = {input_fd, socket_fd, 0};
+    pthread_t uploader;
+    if (pthread_create(&uploader, NULL, upload_raster, &upload) != 0)
+    {
+        fprintf(stderr, "ERROR: Unable to start the upload thread.\n");
+        close(socket_fd);
+        return 1;
+    }
+
+    // The last byte of the reply is the job status, so one byte is always
+    // held back until more follows
+    int failed = 0;
+    int held = 0;
+    unsigned char status = 0;
+    static unsigned char block[CLIENT_BLOCK_SIZE];
+    for (;;)
+    {
+        ssize_t got = read(socket_fd, block, sizeof(block));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            fprintf(stderr, "ERROR: Lost the label server: %s\n", strerror(errno));
+            failed = 1;
+            break;
+        }
+        if (got == 0)
+            break;
+        if ((held && write_all(STDOUT_FILENO, &status, 1) < 0) || write_all(STDOUT_FILENO, block, got - 1) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to write print data: %s\n", strerror(errno));
+            failed = 1;
+            break;
+        }
+        status = block[got - 1];
+        held = 1;
+    }
+    if (!failed && !held)
+    {
+        fprintf(stderr, "ERROR: The label server ended the job without a result.\n");
+        failed = 1;
+    }
+    else if (!failed && status != LABEL_SERVER_PRINTED)
+    {
+        fprintf(stderr, "ERROR: The label server could not print the job.\n");
+        failed = 1;
+    }
+
+    pthread_join(uploader, NULL);
+    close(socket_fd);
+    if (input_fd != 0)
+        close(input_fd);
+    return failed || upload.failed;
+}
+
+// Connect to the printer's label server, or return -1 when none is listening
+int connect_label_server(const char *printer_name)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    const char *path = getenv("RW402B_SOCKET");
+    if (path)
+        snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    else
+        snprintf(address.sun_path, sizeof(address.sun_path), "/run/rw402b/%s.sock", printer_name ? printer_name : "default");
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "DEBUG: No label server on %s (%s).\n", address.sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "DEBUG: Sending the job to the label server on %s.\n", address.sun_path);
+    return fd;
+}
+
+// Copy the raster to the server, then shut down our side so it sees the end
+void *upload_raster(void *arg)
+{
+    client_upload_t *upload = arg;
+    static unsigned char block[CLIENT_BLOCK_SIZE];
+
+    for (;;)
+    {
+        ssize_t got = read(upload->input_fd, block, sizeof(block));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to read the raster: %s\n", strerror(errno));
+            upload->failed = 1;
+            break;
+        }
+        if (got == 0)
+            break;
+        if (write_all(upload->socket_fd, block, got) < 0)
+        {
+            fprintf(stderr, "ERROR: Unable to send the raster to the label server: %s\n", strerror(errno));
+            upload->failed = 1;
+            break;
+        }
+    }
+
+    shutdown(upload->socket_fd, SHUT_WR);
+    return NULL;
+}
+
+// Write all of 'data', resuming after short writes and signals
+int write_all(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+    while (length > 0)
+    {
+        ssize_t written = write(fd, p, length);
+        if (written < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        p += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Replace this process with the full filter from the CUPS filter directory
+void run_filter_instead(char *argv[])
+{
+    const char *serverbin = getenv("CUPS_SERVERBIN");
+    char filter[1024];
+    snprintf(filter, sizeof(filter), "%s/filter/rastertorw402b", serverbin ? serverbin : "/usr/lib/cups");
+
+    argv[0] = "rastertorw402b";
+    execv(filter, argv);
+    fprintf(stderr, "ERROR: Unable to run %s: %s\n", filter, strerror(errno));
+}
@@ -0,0 +1,173 @@
+#!/bin/sh
+###############################################################################
+#
+# Munbyn RW402B CUPS Raster Filter - end-to-end benchmark
+#
+# Prints a corpus of label files (PDF, PNG, raster, anything CUPS converts)
+# through cupsfilter with the RW402B PPD and the installed filter, and
+# records for each file the wall time per label, the peak RSS of
+# rastertorw402b, the TSPL bytes per label and a hash of the TSPL. The
+# results are compared with a stored baseline. Time, memory and bytes may
+# grow by the tolerance, the TSPL itself has to stay byte for byte the same,
+# so an optimization that claims to keep the output can be checked.
+#
+# A file named after a PPD page size, such as w288h432-ups.pdf, is printed
+# on that size. Anything else uses the PPD default.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+###############################################################################
+
+usage()
+{
+    cat >&2 <<EOF
+Usage: rastertorw402b-e2e.sh [-b baseline] [-u] [-t percent] [-n runs] [-o option=value ...] corpus ...
+Corpus entries are label files or directories of them.
+  -b  baseline file (default rastertorw402b-e2e.baseline)
+  -u  write the baseline from this run instead of comparing
+  -t  allowed growth of time, memory and bytes in percent (default 10)
+  -n  runs per file, the fastest counts (default 3)
+  -o  job option passed to the filter, may be repeated
+The PPD is \$RW402B_PPD or the one next to this script, cupsfilter is \$CUPSFILTER.
+EOF
+    exit 2
+}
+
+baseline=rastertorw402b-e2e.baseline
+update=0
+tolerance=10
+runs=3
+options=
+while getopts "b:ut:n:o:" flag; do
+    case $flag in
+    b) baseline=$OPTARG ;;
+    u) update=1 ;;
+    t) tolerance=$OPTARG ;;
+    n) runs=$OPTARG ;;
+    o) options="$options -o $OPTARG" ;;
+    *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || usage
+
+ppd=${RW402B_PPD:-$(dirname "$0")/Munbyn-RW402B-linux.ppd}
+cupsfilter=${CUPSFILTER:-cupsfilter}
+if [ ! -r "$ppd" ]; then
+    echo "ERROR: Unable to read the PPD $ppd." >&2
+    exit 2
+fi
+if [ $update = 0 ] && [ ! -r "$baseline" ]; then
+    echo "ERROR: No baseline $baseline, create one with -u." >&2
+    exit 2
+fi
+
+work=$(mktemp -d) || exit 2
+trap 'rm -rf "$work"' EXIT INT TERM
+: >"$work/results"
+
+# True when 'new' is more than the tolerance above 'old'
+worse()
+{
+    awk -v new="$1" -v old="$2" -v t="$tolerance" 'BEGIN { exit !(new > old * (1 + t / 100)) }'
+}
+
+# One result line per file: name, labels, microseconds per label, peak RSS
+# in KiB, TSPL bytes per label, SHA-256 of the TSPL. Tab separated.
+run_file()
+{
+    file=$1
+    name=$(basename "$file")
+    size=
+    case $name in
+    w[0-9]*h[0-9]*[-_.]*) size="-o PageSize=${name%%[-_.]*}" ;;
+    esac
+
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        start=$(date +%s%N)
+        # Word splitting of the option lists is intended
+        # shellcheck disable=SC2086
+        if ! "$cupsfilter" -p "$ppd" -m application/vnd.rw402b-commands -o StageTiming=1 $size $options "$file" \
+            >"$work/out" 2>"$work/err"; then
+            echo "ERROR: cupsfilter failed on $file:" >&2
+            grep -a "ERROR" "$work/err" >&2
+            return 1
+        fi
+        elapsed=$(( ($(date +%s%N) - start) / 1000 ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+
+    labels=$(grep -a -c '^PRINT ' "$work/out")
+    if [ "$labels" = 0 ]; then
+        echo "ERROR: $file printed no labels." >&2
+        return 1
+    fi
+    bytes=$(wc -c <"$work/out")
+    rss=$(sed -n 's/.*Job peak RSS \([0-9]*\) KiB.*/\1/p' "$work/err" | sort -n | tail -n 1)
+    hash=$(sha256sum <"$work/out" | cut -d ' ' -f 1)
+    printf '%s\t%d\t%d\t%d\t%d\t%s\n' "$name" "$labels" $((best / labels)) "${rss:-0}" $((bytes / labels)) "$hash" \
+        >>"$work/results"
+}
+
+failed=0
+for path in "$@"; do
+    if [ -d "$path" ]; then
+        find "$path" -type f | sort >"$work/files"
+    else
+        echo "$path" >"$work/files"
+    fi
+    while IFS= read -r file; do
+        run_file "$file" || failed=1
+    done <"$work/files"
+done
+
+if [ $update = 1 ]; then
+    cp "$work/results" "$baseline"
+    echo "Baseline of $(wc -l <"$baseline") files written to $baseline."
+    exit $failed
+fi
+
+printf '%-32s %6s %10s %9s %11s  %s\n' file labels us/label "RSS KiB" bytes/label status
+tab=$(printf '\t')
+while IFS="$tab" read -r name labels us rss bytes hash; do
+    status=ok
+    old=$(awk -F "$tab" -v name="$name" '$1 == name' "$baseline")
+    if [ -z "$old" ]; then
+        status="not in baseline"
+    else
+        old_us=$(echo "$old" | cut -f 3)
+        old_rss=$(echo "$old" | cut -f 4)
+        old_bytes=$(echo "$old" | cut -f 5)
+        old_hash=$(echo "$old" | cut -f 6)
+        status=
+        [ "$hash" = "$old_hash" ] || status="$status output changed,"
+        worse "$us" "$old_us" && status="$status slower than $old_us us,"
+        worse "$rss" "$old_rss" && status="$status RSS above $old_rss KiB,"
+        worse "$bytes" "$old_bytes" && status="$status more than $old_bytes bytes,"
+        if [ -n "$status" ]; then
+            failed=1
+            status=${status%,}
+            status=${status# }
+        else
+            status=ok
+        fi
+    fi
+    printf '%-32s %6d %10d %9d %11d  %s\n' "$name" "$labels" "$us" "$rss" "$bytes" "$status"
+done <"$work/results"
+
+exit $failed
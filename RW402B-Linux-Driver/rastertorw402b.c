@@ -27,12 +27,59 @@
 #include <cups/cups.h>
 #include <cups/raster.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Label setup last sent to the printer in this job, so pages only repeat the
+// commands whose values changed
+typedef struct tspl_state_s
+{
+    int valid; // Nothing has been sent yet when clear
+    int page_width_mm;
+    int page_height_mm;
+    int gap_height;
+    int gap_offset;
+    int horizontal_offset;
+    int vertical_offset;
+    int darkness;
+    int speed;
+    int status_reasons; // Status bits currently reported with STATE:
+    int status_silent;  // The printer did not answer a status query
+} tspl_state_t;
+
+// Last page sent with DifferentialUpdate, which is what the printer's image
+// buffer holds until the next CLS. 'height' is 0 when nothing is known.
+typedef struct retained_page_s
+{
+    unsigned char *data;
+    size_t size; // Allocated bytes of 'data'
+    int width_bytes;
+    int height;
+} retained_page_t;
 
 // Structure to hold all print job settings
 typedef struct print_job_config_s
@@ -52,42 +99,525 @@ typedef struct print_job_config_s
     int horizontal_offset;
     int vertical_offset;
     int print_mode;
+    int gamma;    // Tone curve exponent in hundredths, above 100 darkens gray
+    int contrast; // Contrast change in percent around mid gray
+    unsigned char tone[256]; // Gray remap built from negative, contrast and gamma
+    int tone_identity;       // Set when 'tone' leaves every level alone
     int page_width_mm;
     int page_height_mm;
+    int band_height; // Lines per streaming band, 0 buffers the whole page
+    int dither_threads; // Worker threads for dithering, 0 or 1 runs serially
+    int page_threads; // Whole pages converted at once, 0 or 1 converts one at a time
+    int pages_in_flight; // Pages read but not yet sent with page_threads, 0 picks two per thread
+    int pipeline; // Read, process and write bands on separate threads
+    int sparse_bitmap; // Send only the inked rectangles of each page
+    int banded_bitmap; // Send each band as its own BITMAP as soon as it is ready
+    int collapse_duplicates; // Fold runs of identical pages into one PRINT
+    int differential; // Overwrite only what changed since the previous page
+    int form_cache; // Keep the static layer of each label in printer flash
+    int stage_timing; // Report per-page stage times on stderr
+    int status_polling; // Ask the printer for its status before each label
+    int form_area[4]; // Variable area x,y,w,h in dots, excluded from the form
+    struct form_cache_s *forms; // Forms already stored on this printer
+    tspl_state_t sent; // Setup commands already sent in this job
+    retained_page_t retained; // Image buffer contents for differential updates
+    struct buffer_pool_s *pool; // Buffers kept from job to job by the label server, NULL for one job
 } print_job_config_t;
 
+// Bands in flight between the pipeline stages, and the band height used when
+// BandHeight does not set one
+#define PIPELINE_BANDS 4
+#define PIPELINE_BAND_HEIGHT 64
+
+// One band of a page travelling through the pipeline
+typedef struct band_s
+{
+    cups_page_header2_t header; // Page header, copied into every band
+    int first;                  // Band opens a page
+    int last;                   // Band closes a page
+    int end;                    // No more pages follow
+    int blank;                  // Reading failed, send the band as white
+    unsigned y;                 // First page line in the band
+    unsigned rows;
+    unsigned char *gray;
+    size_t gray_size;
+    unsigned char *mono;
+    size_t mono_size;
+} band_t;
+
+// Bounded FIFO of bands handed from one stage to the next
+typedef struct band_queue_s
+{
+    band_t *slots[PIPELINE_BANDS];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} band_queue_t;
+
+// The free bands and the queues between reader, processor and writer
+typedef struct pipeline_s
+{
+    print_job_config_t *config;
+    band_queue_t free_bands;
+    band_queue_t read_bands;
+    band_queue_t done_bands;
+    band_t bands[PIPELINE_BANDS];
+} pipeline_t;
+
+// A dithered, mirrored and rotated page ready for sending
+typedef struct mono_page_s
+{
+    unsigned char *data;
+    unsigned width_bytes;
+    unsigned height;
+    size_t size;
+} mono_page_t;
+
+// Most worker threads and pages in flight for page-level parallelism
+#define PAGE_THREADS_MAX 64
+#define PAGES_IN_FLIGHT_MAX 256
+
+// Where a page of the parallel path is. A slot goes FREE -> READ ->
+// CONVERTING -> DONE -> FREE, owned in turn by the reader, a worker and the
+// writer.
+enum page_slot_state_e
+{
+    PAGE_SLOT_FREE = 0,
+    PAGE_SLOT_READ,
+    PAGE_SLOT_CONVERTING,
+    PAGE_SLOT_DONE
+};
+
+// One page in flight. Page n always uses slot n % pages_in_flight, which
+// makes the slots the reorder buffer as well: the writer waits for the slot
+// of the next page in order.
+typedef struct page_slot_s
+{
+    int state;
+    int end;    // No more pages follow
+    int failed; // Conversion failed, the page is dropped
+    cups_page_header2_t header;
+    unsigned char *raster; // Page as read, converted in place
+    size_t raster_size;
+    unsigned char *mono;   // Swapped with the POOL_MONO buffer of whoever converts or sends it
+    size_t mono_size;
+    mono_page_t page;
+} page_slot_t;
+
+// The page slots shared by the reader, the workers and the writer
+typedef struct page_workers_s
+{
+    print_job_config_t *config;
+    page_slot_t *slots;
+    int in_flight;
+    long next_convert; // Next page for a worker to take
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Broadcast whenever a slot changes state
+} page_workers_t;
+
+// Maximum number of forms kept on one printer before the oldest is deleted
+#define FORM_CACHE_MAX 16
+
+// One stored-graphics file known to be in printer flash
+typedef struct form_entry_s
+{
+    uint64_t hash;  // Hash of the packed static layer
+    char name[16];  // TSPL file name, such as "F1A2B3C4.BMP"
+    long last_used; // Unix time the form was last printed
+} form_entry_t;
+
+// On-disk index of the forms stored on one printer
+typedef struct form_cache_s
+{
+    char path[1024];
+    int lock_fd; // Held from load to close, one job at a time per printer
+    int dirty;   // Last-used times changed since the index was written
+    int count;
+    form_entry_t entries[FORM_CACHE_MAX];
+} form_cache_t;
+
+// Packed page held back until the next one shows whether it repeats
+typedef struct pending_page_s
+{
+    unsigned char *mono_data;
+    int width_bytes;
+    int height;
+    uint64_t hash;
+    int count; // Consecutive identical pages seen so far
+} pending_page_t;
+
+// Image algorithms selectable with the PrintMode PPD option
+enum print_mode_e
+{
+    PRINT_MODE_NONE = 0,            // Plain threshold at mid gray
+    PRINT_MODE_DIFFUSION = 2,       // Floyd-Steinberg
+    PRINT_MODE_GATHERING = 3,       // Floyd-Steinberg
+    PRINT_MODE_ERROR_DIFFUSION = 4, // Floyd-Steinberg
+    PRINT_MODE_DEFAULT = 5,         // Floyd-Steinberg
+    PRINT_MODE_BAYER = 6,           // Ordered dither with an 8x8 Bayer tile
+    PRINT_MODE_BLUE_NOISE = 7,      // Ordered dither with a 32x32 blue-noise tile
+    PRINT_MODE_SERPENTINE = 8,      // Floyd-Steinberg, serpentine fixed-point
+    PRINT_MODE_ATKINSON = 9,        // Atkinson, serpentine
+    PRINT_MODE_STUCKI = 10,         // Stucki, serpentine
+    PRINT_MODE_SIERRA_LITE = 11     // Sierra Lite, serpentine
+};
+
+// Error lines kept by the serpentine kernels: the line being quantized and
+// the two below it. Each is padded by two entries on both sides, the widest
+// reach of any kernel, so no neighbour write needs a bounds check.
+#define KERNEL_ROWS 3
+#define KERNEL_PAD 2
+
+// Per-page dithering state. The Floyd-Steinberg error rows are padded by one
+// entry on both sides so spills off the left and right edges land in scratch
+// slots.
+typedef struct dither_state_s
+{
+    int width;
+    int print_mode;
+    int threads;              // Worker threads, 0 or 1 runs serially
+    unsigned char *threshold; // Per-pixel threshold lines for the pack kernel
+    int threshold_rows;       // Number of threshold lines, repeated down the page
+    int row;                  // Page line the next call starts at
+    unsigned char *line;      // Quantized line waiting to be packed
+    int *current;             // Error accumulated for the line being quantized
+    int *next;                // Error spilled into the following line
+    int *error_rows;          // Ring of padded error lines for the serpentine kernels
+    unsigned char tone[256];  // Gray level remap applied while quantizing
+    int tone_identity;        // Set when 'tone' leaves every level alone
+} dither_state_t;
+
+// Ordered dither thresholds. A pixel prints white when its gray value is at
+// least the tile entry, so 0 is always black and 255 always white.
+static const unsigned char bayer_tile[8 * 8] = {
+      2, 130,  34, 162,  10, 138,  42, 170,
+    194,  66, 226,  98, 202,  74, 234, 106,
+     50, 178,  18, 146,  58, 186,  26, 154,
+    242, 114, 210,  82, 250, 122, 218,  90,
+     14, 142,  46, 174,   6, 134,  38, 166,
+    206,  78, 238, 110, 198,  70, 230, 102,
+     62, 190,  30, 158,  54, 182,  22, 150,
+    254, 126, 222,  94, 246, 118, 214,  86,
+};
+
+// Generated with void-and-cluster (Gaussian sigma 1.5), tileable
+static const unsigned char blue_noise_tile[32 * 32] = {
+    160, 121, 197, 145,  55, 104, 184,  45,   6, 162,  94, 142, 213,   1,  36,  91,
+    246,  11,  80,  46, 211,   7, 247, 181,  15, 232,  46, 187, 111,  33, 227,  73,
+    236,  26,  95,   4, 204,  23, 244, 125, 215, 231,  30,  51,  76, 179, 227, 113,
+    199, 134, 219, 176, 144,  67, 127,  87, 141,  64, 207,  89, 151,  57, 202, 137,
+     49, 211, 172, 253, 133,  73, 151,  90,  58, 113, 185, 240, 154, 120,  57, 161,
+     28,  63, 109,  19,  96, 203, 157,  28, 241, 102, 162,   2, 234, 173,  19, 105,
+     87, 149,  66,  39, 109, 223, 181,  32, 171, 135,  14, 105, 199,  22, 250,  85,
+    185, 224, 166, 252,  35, 231,  54, 171, 199,  37, 218, 132,  78, 117, 190, 243,
+     11, 125, 219, 191, 163,  57,  10, 199, 253,  68, 210,  85,  41, 141, 208,   9,
+    128,  43,  79, 149, 124, 184,  83,   9, 121,  73, 182,  51, 255,  31,  64, 161,
+    182,  34, 100,  16,  88, 242, 127,  99, 147,  45, 158, 237, 174,  65,  96, 155,
+    237, 104, 200,   2,  70, 212, 110, 249, 150, 229,  19, 108, 157, 207, 135, 223,
+     75, 248, 158, 229, 139,  38, 209,  74,  20, 220, 124,   3, 110, 226, 189,  48,
+    214,  29, 176, 241,  47, 143,  26, 178,  59,  92, 140, 194,  81,   9,  97,  44,
+    202, 134,  50, 197,  69, 184, 152, 238, 112, 175,  80, 196,  36, 137,  20, 122,
+     68, 142,  91, 119, 165, 220, 101, 205,  40, 168, 242,  33, 219, 169, 236, 116,
+    174,   2,  84, 120,  26, 102,   6,  58, 194,  31, 249,  56, 160, 238,  90, 167,
+    252, 194,  18, 225,  82,  14,  64, 126, 223,   3, 115,  63, 127,  47, 144,  25,
+     93, 234, 154, 209, 251, 175, 225, 126, 156,  92, 137, 105, 215,  69, 204,   7,
+    111,  54, 155,  39, 190, 245, 153, 186,  82, 143, 201,  95, 188, 251,  71, 212,
+     52, 112,  20,  60, 137,  39,  76, 212,  47, 232,  10, 182,  22, 128,  43, 186,
+    232,  78, 212, 103, 132,  51,  97,  21, 252,  47, 227,  24, 161,  11, 107, 183,
+    243, 168, 220, 189,  89, 166, 111,  18, 173,  72, 202, 147,  83, 247, 156,  94,
+    136,  20, 174, 237,   7, 170, 214, 119, 160,  70, 176, 131,  81, 221, 152,  29,
+    142,  77,  42, 126,   8, 229, 193, 142, 254, 108,  32, 226, 117,  59, 177,  32,
+    206, 116,  63, 146,  88, 228,  74,  36, 205,  12, 109, 242,  35, 198,  62, 119,
+     11, 204, 104, 241, 148,  64,  33,  94,  54, 131, 167,  49, 188,  13, 215,  72,
+    150, 246,  44, 198, 125,  21, 190, 141, 234,  86, 192,  56, 140,  99, 230, 187,
+    250,  61, 159,  29, 200, 116, 236, 211, 182,   5, 206,  96, 239, 136, 110, 230,
+      1,  86, 178,  30, 242,  61, 164,  98,  51, 121, 151, 217,   5, 172,  45,  88,
+    122, 179, 221,  94,  72, 172,  16, 153,  77, 245,  65, 157,  23,  79, 165,  54,
+    192, 130, 222, 101, 153, 114, 219,   1, 255, 179,  23,  76, 246, 115, 156,  26,
+    145,  49,   1, 136, 255,  50, 129,  91,  36, 120, 143, 218,  44, 198, 253,  29,
+    106, 163,  69,  12, 211,  35, 187,  72, 136,  41, 205,  96, 188,  65, 232, 208,
+     78, 238, 112, 183,  25, 197, 226, 165, 216, 191,  17, 100, 174, 126,  89, 149,
+    210,  42, 248, 172,  55,  92, 123, 224, 169, 108, 230, 160,  33, 130,  15,  99,
+     34, 154, 217,  84, 148, 102,  68,   9, 106,  58, 241,  74, 225,   8,  62, 231,
+     17, 121,  80, 138, 200, 244, 150,  24,  53,  84,  10, 139,  55, 215, 163, 186,
+     69, 200,  18,  57, 236,  37, 181, 247, 135, 171,  38, 156, 115, 193, 138, 179,
+     99, 194, 224,  28, 113,   8,  66, 185, 208, 247, 116, 195, 240,  84, 112, 253,
+    139, 106, 170, 132, 203, 117, 155,  24,  82, 201, 123, 210,  27,  55, 238,  34,
+     71, 158,  52, 180,  89, 168, 229, 101, 134,  35, 162,  68,  21, 175,  46,   6,
+    227,  50, 246,  77,   5, 228,  90, 188,  49, 235,   4,  92, 255, 107, 167, 122,
+    218,   3, 239, 129, 209,  42, 145,  17,  78, 177, 221,  97, 148, 233, 129, 195,
+    161,  25,  97, 178,  45, 143,  60, 213, 114, 151,  67, 140, 177,  79,  13, 196,
+     86, 146, 107,  21,  73, 251, 118, 205, 239,  59,   4, 124,  34, 207,  95,  70,
+    118, 213, 148, 223, 195, 103, 250,  12, 166,  40, 217, 193,  37, 228, 150,  44,
+    250,  61, 190, 218, 163,  56, 189,  32,  91, 131, 192, 249, 167,  60,  16, 185,
+     37,  85,  12,  66, 123,  22, 173, 131,  88, 243, 103,  18, 128,  63, 213,  98,
+    133, 170,  38,  90, 141,   7, 106, 169, 146, 216,  46, 109,  81, 224, 145, 244,
+    204, 140, 254, 164,  40, 235,  71, 208,  27, 183,  75, 160, 235, 114, 180,  27,
+    202,  14, 233, 124, 244, 203,  77, 228,  19,  70, 158,  14, 181, 122,  48, 103,
+    176,  53, 113, 187,  83, 198, 147,  53, 119, 221, 138,  43, 196,   6,  82, 245,
+    118,  76, 157,  52,  25, 177, 120,  39, 254,  98, 201, 239,  31, 216, 159,   4,
+    233,  75,  27, 225, 133,   2, 102, 230, 169,  10,  62, 248,  96, 170,  56, 155,
+     42, 222, 184, 108,  87, 224,  59, 154, 186, 123,  53, 135,  85,  61, 191,  93,
+    127, 206, 152,  98,  50, 248, 162,  32,  86, 201, 115, 149,  28, 207, 129, 231,
+     93, 139,   3, 209, 164, 132,  15, 210,  83,   5, 175, 226, 152, 114, 245,  24,
+     58, 171,  13, 214, 180,  71, 195, 138,  48, 234, 180,  80, 222, 110,  15, 173,
+     30, 197,  66, 252,  41,  75, 237, 105, 144, 243,  40, 100,  13, 203,  43, 144,
+    107, 249,  87, 130,  31, 117,  16, 240, 100, 130,  17,  41, 166,  60, 240,  74,
+    217, 104, 125,  23, 147, 193, 168,  30,  62, 196,  79, 214, 164,  67, 178, 220,
+    189,  38,  65, 235, 165, 222,  81, 153, 206,  67, 192, 254, 101, 133, 191, 146,
+     48, 159, 183, 233,  93, 118,  52, 216, 111, 159, 128,  22, 251, 134,  95,   8,
+};
+
+// Buffers owned by a buffer pool
+enum pool_slot_e
+{
+    POOL_RASTER = 0, // 8-bit page or band as read from the raster stream
+    POOL_MONO,       // Packed page or band
+    POOL_PENDING,    // Packed page held back by duplicate detection
+    POOL_ROTATED,    // Packed page after rotation
+    POOL_SLOTS
+};
+
+// Per-job buffers recycled from page to page. Each slot only ever grows, so
+// after the largest page of a job no more allocations happen.
+typedef struct buffer_pool_s
+{
+    unsigned char *buffers[POOL_SLOTS];
+    size_t sizes[POOL_SLOTS];
+    dither_state_t dither; // Reused while page width and mode stay the same
+    int dither_ready;
+    long allocations;      // Buffers that had to be allocated or grown
+    long allocations_saved; // Requests served from an existing buffer
+} buffer_pool_t;
+
+// Stages timed by a stage_timer_t. Packing is fused into dithering, so the
+// dither stage includes it.
+enum stage_e
+{
+    STAGE_HEADER = 0, // cupsRasterReadHeader2
+    STAGE_READ,       // cupsRasterReadPixels
+    STAGE_DITHER,     // Quantizing and packing
+    STAGE_MANIPULATE, // Mirror and rotation of the packed page
+    STAGE_WRITE,      // Duplicate detection and TSPL output
+    STAGE_COUNT
+};
+
+// Bitmap bytes for the whole job, kept by the output functions
+typedef struct output_stats_s
+{
+    long page_bytes;   // Size of every page bitmap that was sent
+    long bitmap_bytes; // Bitmap data actually written
+} output_stats_t;
+
+// Bitmap bytes of the job so far
+output_stats_t output_stats;
+
+// Per-page and per-job stage times, only kept when 'enabled' is set
+typedef struct stage_timer_s
+{
+    int enabled;
+    int page;    // Page being timed, 0 before the first
+    double mark; // Time the current stage started
+    double job_start;
+    double page_seconds[STAGE_COUNT];
+    double job_seconds[STAGE_COUNT];
+    output_stats_t page_start; // output_stats when the page started
+} stage_timer_t;
+
+// Label server protocol. A client sends these fields, each ending in a NUL,
+// then the raster stream until it shuts down its side of the connection.
+// Without a device the TSPL output comes back on the same connection. Either
+// way the reply ends with one status byte, LABEL_SERVER_PRINTED or
+// LABEL_SERVER_FAILED. rastertorw402b-client.c speaks the other side.
+#define LABEL_SERVER_MAGIC "RW402B/2"
+#define LABEL_SERVER_HEADER_SIZE 65536
+#define LABEL_SERVER_BACKLOG 16
+#define LABEL_SERVER_TIMEOUT 30 // Seconds a client may stall before its job is dropped
+#define LABEL_SERVER_PRINTED 0
+#define LABEL_SERVER_FAILED 1
+
+enum label_field_e
+{
+    LABEL_FIELD_MAGIC = 0,
+    LABEL_FIELD_JOB_ID,
+    LABEL_FIELD_USER,
+    LABEL_FIELD_TITLE,
+    LABEL_FIELD_COPIES,
+    LABEL_FIELD_OPTIONS,
+    LABEL_FIELD_PRINTER,
+    LABEL_FIELD_COUNT
+};
+
+// Read-ahead block for raster input that cannot be mapped
+#define INPUT_BLOCK_SIZE (1024 * 1024)
+
+// Raster input handed to libcups through cupsRasterOpenIO(). A regular file
+// is mapped whole and served from the map, anything else (the usual stdin
+// pipe) goes through one large aligned read-ahead block.
+typedef struct raster_input_s
+{
+    int fd;
+    const unsigned char *map; // Mapped file, NULL when reading ahead
+    size_t map_length;
+    unsigned char *block;     // Read-ahead block of INPUT_BLOCK_SIZE bytes
+    size_t position;          // Next byte to hand out, in the map or block
+    size_t available;         // Bytes in the map or block
+    long reads;               // read() calls made, for the debug log
+    int timed_out;            // A read ran into the socket timeout, the input is gone
+} raster_input_t;
+
+// Resolution of the print head. Gray raster rendered finer than this, as
+// some applications do whatever the PPD says, is area averaged down to it
+// before dithering so the label prints at its real size.
+#define PRINTER_DPI 203
+
+// Fixed-point sum of the weights of one output pixel along either axis
+#define DOWNSCALE_ONE 4096
+
+// Area-average downscaler from a page's raster size to its size at
+// PRINTER_DPI, fed any number of lines at a time. Each output pixel is the
+// mean of the input area it covers, with partly covered input pixels
+// weighted by how much of them it covers. Weights along each axis add up to
+// DOWNSCALE_ONE, so a sum of 8-bit pixels fits 32 bits.
+typedef struct downscale_s
+{
+    int in_width;
+    int in_height;
+    int out_width;
+    int out_height;
+    int *tap_start;   // First tap of each output column, out_width + 1 entries
+    int *tap_input;   // Input column of each tap
+    int *tap_weight;  // Share of the output column that input column covers
+    uint32_t *line;   // Current input line, averaged across
+    uint32_t *sum;    // Weighted lines of the output line being built
+    int in_y;         // Input lines consumed
+    int out_y;        // Output lines finished
+} downscale_t;
+
+// Pack kernel: set the bit (white) of every pixel whose gray value is at
+// least its threshold, and pad the last byte of the line with white
+typedef void (*pack_threshold_fn)(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int width);
+
 // Function Prototypes
 void process_raster_page(cups_raster_t *raster, print_job_config_t *config);
+int process_raster_bands(cups_raster_t *raster, cups_page_header2_t *header, print_job_config_t *config, buffer_pool_t *pool,
+                         stage_timer_t *timer);
+void process_raster_pipelined(cups_raster_t *raster, print_job_config_t *config);
+void process_raster_parallel(cups_raster_t *raster, print_job_config_t *config);
+int convert_raster_page(const cups_page_header2_t *header, unsigned char *raster_data, print_job_config_t *config,
+                        buffer_pool_t *pool, stage_timer_t *timer, mono_page_t *page);
+void write_mono_page(const mono_page_t *page, pending_page_t *pending, print_job_config_t *config, buffer_pool_t *pool);
+void stage_timer_init(stage_timer_t *timer, int enabled);
+void stage_timer_start(stage_timer_t *timer);
+void stage_timer_mark(stage_timer_t *timer, int stage);
+void stage_timer_page(stage_timer_t *timer);
+void stage_timer_finish(stage_timer_t *timer);
+void stage_timer_finish_overlapped(stage_timer_t *timer);
+void band_queue_init(band_queue_t *queue);
+void band_queue_destroy(band_queue_t *queue);
+void band_queue_push(band_queue_t *queue, band_t *band);
+band_t *band_queue_pop(band_queue_t *queue);
+void set_default_options(print_job_config_t *config);
 void set_pstops_options(print_job_config_t *config, int num_options, cups_option_t *options, const char *ppd_file);
-void apply_image_manipulations(unsigned char *bitmap, unsigned *width, unsigned *height, print_job_config_t *config);
-void convert_gray_to_mono(unsigned char *gray_data, unsigned char *mono_data, int width, int height, int print_mode);
-void error_diffusion(int *input_data, int width, int height);
-void send_printer_commands(unsigned char *mono_data, int width_bytes, int height_pixels, print_job_config_t *config);
+void build_tone_curve(print_job_config_t *config);
+void apply_image_manipulations(unsigned char *mono_data, int width, int rows, print_job_config_t *config);
+int raster_is_bilevel(const cups_page_header2_t *header);
+int raster_is_supported(const cups_page_header2_t *header);
+void raster_to_gray(const cups_page_header2_t *header, unsigned char *raster_data, int rows);
+int skip_raster_page(cups_raster_t *raster, const cups_page_header2_t *header);
+int downscale_size(unsigned width, unsigned height, const unsigned resolution[2], unsigned *out_width, unsigned *out_height);
+int raster_scaled_size(const cups_page_header2_t *header, unsigned *width, unsigned *height);
+int downscale_init(downscale_t *scale, int in_width, int in_height, int out_width, int out_height);
+int downscale_rows(downscale_t *scale, const unsigned char *gray_data, unsigned char *out_data, int rows);
+void downscale_free(downscale_t *scale);
+int downscale_page(unsigned char *gray_data, int in_width, int in_height, int out_width, int out_height);
+void copy_bilevel_rows(const unsigned char *raster_data, int bytes_per_line, unsigned char *mono_data, int width, int rows,
+                       int invert);
+int convert_gray_to_mono(unsigned char *gray_data, unsigned char *mono_data, int width, int height, int print_mode, int threads);
+int dither_init(dither_state_t *state, int width, int print_mode, int threads);
+void dither_free(dither_state_t *state);
+void dither_restart(dither_state_t *state);
+void dither_set_tone(dither_state_t *state, const print_job_config_t *config);
+unsigned char *pool_get(buffer_pool_t *pool, int slot, size_t size);
+void pool_swap(buffer_pool_t *pool, int slot_a, int slot_b);
+dither_state_t *pool_dither(buffer_pool_t *pool, int width, int print_mode, int threads);
+void pool_free(buffer_pool_t *pool);
+void dither_rows(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows);
+void error_diffusion(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows);
+int error_diffusion_wavefront(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows);
+void kernel_diffusion(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows);
+int dither_ordered_parallel(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows);
+void pack_init(void);
+extern pack_threshold_fn pack_threshold_line;
+void pack_threshold_scalar(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int width);
+void mirror_mono_row(unsigned char *line, int width);
+void rotate_mono(const unsigned char *src, unsigned char *dst, int width, int height, int rotate);
+uint64_t page_hash(const unsigned char *data, size_t length);
+void flush_pending_page(pending_page_t *pending, print_job_config_t *config);
+int raster_input_open(raster_input_t *input, int fd);
+ssize_t raster_input_read(void *ctx, unsigned char *buffer, size_t length);
+size_t raster_input_peek(raster_input_t *input, unsigned char *buffer, size_t length);
+void raster_input_close(raster_input_t *input);
+int label_server(const char *socket_path, const char *device_path);
+int serve_label_job(int connection, buffer_pool_t *pool, tspl_state_t *sent, int device_fd);
+void output_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void output_text(const char *text, size_t length);
+void output_data(const void *data, size_t length);
+void output_rows(const unsigned char *data, size_t length, int rows, size_t stride);
+int output_flush(void);
+void output_set_fd(int fd);
+void send_printer_commands(unsigned char *mono_data, int width_bytes, int height_pixels, int copies, print_job_config_t *config);
+int send_sparse_bitmap(const unsigned char *mono_data, int width_bytes, int rows, int y_offset, int bitmaps_sent);
+int send_differential_page(const unsigned char *mono_data, int width_bytes, int height_pixels, int copies,
+                           print_job_config_t *config);
+void retain_page(retained_page_t *retained, const unsigned char *mono_data, int width_bytes, int height_pixels);
+void retained_page_free(retained_page_t *retained);
+int page_setup_changed(const print_job_config_t *config);
+void send_page_setup(print_job_config_t *config);
+int query_printer_status(void);
+void wait_for_printer(print_job_config_t *config);
+void begin_band_page(print_job_config_t *config, int width_bytes, int height_pixels);
+int send_band(print_job_config_t *config, const unsigned char *mono_data, int width_bytes, int rows, int y, int bitmaps_sent);
+void send_page_trailer(int copies);
+int page_needs_whole_buffer(const print_job_config_t *config);
+int page_has_bitmap_header(const print_job_config_t *config);
+void form_cache_load(form_cache_t *cache, const char *printer_name);
+void form_cache_save(const form_cache_t *cache);
+void form_cache_close(form_cache_t *cache);
+int send_form_page(const unsigned char *mono_data, int width_bytes, int height_pixels, int copies, print_job_config_t *config);
 
+// The benchmark includes this file and brings its own main
+#ifndef RW402B_NO_MAIN
 // Main function - entry point for the CUPS filter
 int main(int argc, char *argv[])
 {
+    // Label server: rastertorw402b --serve socket [device]
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "--serve") == 0)
+    {
+        pack_init();
+        return label_server(argv[2], argc == 4 ? argv[3] : NULL) < 0 ? 1 : 0;
+    }
+
     if (argc < 6 || argc > 7)
     {
         fprintf(stderr, "ERROR: rastertorw402b job-id user title copies options [file]\n");
         return 1;
     }
 
+    pack_init();
+
     print_job_config_t config = {0};
     config.job_id = atoi(argv[1]);
     config.user = argv[2];
     config.title = argv[3];
     config.copies = atoi(argv[4]);
 
-    // Default settings
-    config.speed = 4;
-    config.darkness = 12;
-    config.mediaType = 1;
-    config.gap_height = 3;
+    set_default_options(&config);
 
-    int num_options = cupsParseOptions(argv[5], 0, NULL);
     cups_option_t *options = NULL;
-    cupsParseOptions(argv[5], num_options, &options);
+    int num_options = cupsParseOptions(argv[5], 0, &options);
 
     // PPD path is derived from the printer name, which is an environment variable
     const char *printer_name = getenv("PRINTER");
@@ -102,6 +632,13 @@ int main(int argc, char *argv[])
         set_pstops_options(&config, num_options, options, NULL);
     }
 
+    form_cache_t forms;
+    if (config.form_cache)
+    {
+        form_cache_load(&forms, printer_name ? printer_name : "default");
+        config.forms = &forms;
+    }
+
     int fd = 0; // Default to stdin
     if (argc == 7)
     {
@@ -114,7 +651,10 @@ int main(int argc, char *argv[])
         }
     }
 
-    cups_raster_t *raster = cupsRasterOpen(fd, CUPS_RASTER_READ);
+    raster_input_t input;
+    cups_raster_t *raster = NULL;
+    if (raster_input_open(&input, fd) == 0)
+        raster = cupsRasterOpenIO(raster_input_read, &input, CUPS_RASTER_READ);
     if (raster)
     {
         process_raster_page(raster, &config);
@@ -124,6 +664,9 @@ int main(int argc, char *argv[])
     {
         fprintf(stderr, "ERROR: Could not open raster stream.\n");
     }
+    raster_input_close(&input);
+    if (config.forms)
+        form_cache_close(config.forms);
 
     if (fd != 0)
     {
@@ -133,209 +676,3340 @@ int main(int argc, char *argv[])
     cupsFreeOptions(num_options, options);
     return 0;
 }
+#endif // RW402B_NO_MAIN
+
+// Open the printer for the label server. The status query reads the back
+// channel from descriptor 3, as it does under CUPS, so the device is moved
+// there.
+static int open_label_device(const char *device_path)
+{
+    int fd = open(device_path, O_RDWR);
+    if (fd < 0)
+        fd = open(device_path, O_WRONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to open printer %s: %s\n", device_path, strerror(errno));
+        return -1;
+    }
+    if (fd != 3)
+    {
+        dup2(fd, 3);
+        close(fd);
+    }
+    return 3;
+}
+
+// Serve raster jobs from clients on the Unix socket 'socket_path', one at a
+// time, until an error. The process, its buffers and, with 'device_path',
+// the open printer outlive each job, so a label costs no process start, no
+// allocation and no device open.
+int label_server(const char *socket_path, const char *device_path)
+{
+    // A client that goes away mid-job must not end the server
+    signal(SIGPIPE, SIG_IGN);
+
+    int device_fd = -1;
+    if (device_path && (device_fd = open_label_device(device_path)) < 0)
+        return -1;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "ERROR: Socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to create the label server socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, LABEL_SERVER_BACKLOG) < 0)
+    {
+        fprintf(stderr, "ERROR: Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        close(listener);
+        return -1;
+    }
+    fprintf(stderr, "INFO: Label server listening on %s%s%s.\n", socket_path, device_path ? ", printing to " : "",
+            device_path ? device_path : "");
+
+    buffer_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    tspl_state_t sent = {0};
+    for (;;)
+    {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "ERROR: Label server stopped: %s\n", strerror(errno));
+            break;
+        }
+
+        // Jobs are served one at a time, so a client that stops sending or
+        // reading must not hold up the ones behind it
+        struct timeval timeout = {LABEL_SERVER_TIMEOUT, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        int result = serve_label_job(connection, &pool, &sent, device_fd);
+        close(connection);
+
+        // The printer went away, get a fresh descriptor and resend all setup
+        if (result < 0 && device_fd >= 0)
+        {
+            close(device_fd);
+            memset(&sent, 0, sizeof(sent));
+            if ((device_fd = open_label_device(device_path)) < 0)
+                break;
+        }
+    }
+
+    pool_free(&pool);
+    close(listener);
+    unlink(socket_path);
+    return -1;
+}
+
+// Read the job fields from 'input' into 'header', pointing 'fields' at them
+static int read_job_fields(raster_input_t *input, char *header, size_t size, char *fields[LABEL_FIELD_COUNT])
+{
+    size_t used = 0;
+    for (int i = 0; i < LABEL_FIELD_COUNT; ++i)
+    {
+        fields[i] = header + used;
+        do
+        {
+            if (used == size || raster_input_read(input, (unsigned char *)header + used, 1) != 1)
+                return -1;
+        } while (header[used++] != '\0');
+    }
+    return strcmp(fields[LABEL_FIELD_MAGIC], LABEL_SERVER_MAGIC) == 0 ? 0 : -1;
+}
+
+// Print one client's job. The job's options are parsed as the filter would
+// parse them. With a device open, the setup commands already sent carry over
+// from the previous job, the printer still has them. Returns -1 when writing
+// the output failed.
+int serve_label_job(int connection, buffer_pool_t *pool, tspl_state_t *sent, int device_fd)
+{
+    raster_input_t input;
+    if (raster_input_open(&input, connection) < 0)
+        return 0;
+
+    static char header[LABEL_SERVER_HEADER_SIZE];
+    char *fields[LABEL_FIELD_COUNT];
+    if (read_job_fields(&input, header, sizeof(header), fields) < 0)
+    {
+        fprintf(stderr, "ERROR: Dropping a label server client that sent no valid job header.\n");
+        raster_input_close(&input);
+        return 0;
+    }
+
+    print_job_config_t config = {0};
+    config.job_id = atoi(fields[LABEL_FIELD_JOB_ID]);
+    config.user = fields[LABEL_FIELD_USER];
+    config.title = fields[LABEL_FIELD_TITLE];
+    config.copies = atoi(fields[LABEL_FIELD_COPIES]);
+    set_default_options(&config);
+
+    cups_option_t *options = NULL;
+    int num_options = cupsParseOptions(fields[LABEL_FIELD_OPTIONS], 0, &options);
+    set_pstops_options(&config, num_options, options, NULL);
+    config.pool = pool;
+
+    form_cache_t forms;
+    if (config.form_cache)
+    {
+        form_cache_load(&forms, fields[LABEL_FIELD_PRINTER][0] ? fields[LABEL_FIELD_PRINTER] : "default");
+        config.forms = &forms;
+    }
+
+    if (device_fd >= 0)
+    {
+        config.sent = *sent;
+        config.sent.status_silent = 0;
+        output_set_fd(device_fd);
+    }
+    else
+    {
+        // There is no back channel to ask for status on
+        config.status_polling = 0;
+        output_set_fd(connection);
+    }
+    fprintf(stderr, "INFO: Label server printing job %d for %s.\n", config.job_id, config.user);
+
+    // Byte counts are per job, the server's earlier jobs do not count
+    memset(&output_stats, 0, sizeof(output_stats));
+
+    cups_raster_t *raster = cupsRasterOpenIO(raster_input_read, &input, CUPS_RASTER_READ);
+    if (raster)
+    {
+        process_raster_page(raster, &config);
+        cupsRasterClose(raster);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: Could not open raster stream.\n");
+    }
+    int result = output_flush();
+    if (config.forms)
+        form_cache_close(config.forms);
+
+    // When printing to the device the client sees no output, only this says
+    // whether the job made it
+    unsigned char status = raster && !input.timed_out && result == 0 ? LABEL_SERVER_PRINTED : LABEL_SERVER_FAILED;
+    send(connection, &status, 1, MSG_NOSIGNAL);
+
+    if (device_fd >= 0)
+        *sent = config.sent;
+    raster_input_close(&input);
+    cupsFreeOptions(num_options, options);
+    return result;
+}
 
 // Process a single page from the raster stream
 void process_raster_page(cups_raster_t *raster, print_job_config_t *config)
 {
     cups_page_header2_t header;
-    unsigned char *raster_buffer = NULL;
+    pending_page_t pending = {0};
+    buffer_pool_t job_pool;
+    memset(&job_pool, 0, sizeof(job_pool));
+    buffer_pool_t *pool = config->pool ? config->pool : &job_pool;
+    stage_timer_t timer;
+    stage_timer_init(&timer, config->stage_timing);
 
-    while (cupsRasterReadHeader2(raster, &header))
+    // Stages overlap in the pipeline, so only the job's wall time and byte
+    // counts are reported
+    if ((config->pipeline || config->banded_bitmap) && !page_needs_whole_buffer(config))
     {
+        process_raster_pipelined(raster, config);
+        stage_timer_finish_overlapped(&timer);
+        return;
+    }
+    // Pages are converted side by side, so the same holds for them
+    if (config->page_threads > 1)
+    {
+        process_raster_parallel(raster, config);
+        stage_timer_finish_overlapped(&timer);
+        retained_page_free(&config->retained);
+        return;
+    }
+
+    for (;;)
+    {
+        stage_timer_start(&timer);
+        if (!cupsRasterReadHeader2(raster, &header))
+            break;
         if (header.cupsWidth == 0 || header.cupsHeight == 0 || header.cupsBytesPerLine == 0)
             continue;
+        if (!raster_is_supported(&header))
+        {
+            fprintf(stderr, "ERROR: Skipping a page with %u bits per pixel in color space %d.\n", header.cupsBitsPerPixel,
+                    header.cupsColorSpace);
+            if (skip_raster_page(raster, &header) < 0)
+                break;
+            continue;
+        }
+        stage_timer_page(&timer);
+        stage_timer_mark(&timer, STAGE_HEADER);
+
+        if (config->band_height > 0 && !page_needs_whole_buffer(config))
+        {
+            if (process_raster_bands(raster, &header, config, pool, &timer) < 0)
+                break;
+            continue;
+        }
 
-        raster_buffer = malloc(header.cupsHeight * header.cupsBytesPerLine);
+        unsigned char *raster_buffer = pool_get(pool, POOL_RASTER, (size_t)header.cupsHeight * header.cupsBytesPerLine);
         if (!raster_buffer)
         {
             fprintf(stderr, "ERROR: Unable to allocate memory for raster page.\n");
-            return;
+            break;
         }
 
         if (cupsRasterReadPixels(raster, raster_buffer, header.cupsHeight * header.cupsBytesPerLine) == 0)
         {
-            free(raster_buffer);
             fprintf(stderr, "ERROR: Failed to read raster pixels.\n");
-            return;
+            break;
         }
+        stage_timer_mark(&timer, STAGE_READ);
 
-        unsigned width = header.cupsWidth;
-        unsigned height = header.cupsHeight;
-
-        apply_image_manipulations(raster_buffer, &width, &height, config);
-
-        unsigned mono_width_bytes = (width + 7) / 8;
-        unsigned char *mono_buffer = malloc(mono_width_bytes * height);
-        if (!mono_buffer)
-        {
-            fprintf(stderr, "ERROR: Unable to allocate memory for monochrome buffer.\n");
-            free(raster_buffer);
-            return;
-        }
+        mono_page_t page;
+        if (convert_raster_page(&header, raster_buffer, config, pool, &timer, &page) < 0)
+            break;
+        write_mono_page(&page, &pending, config, pool);
+        stage_timer_mark(&timer, STAGE_WRITE);
+    }
 
-        convert_gray_to_mono(raster_buffer, mono_buffer, width, height, config->print_mode);
-        send_printer_commands(mono_buffer, mono_width_bytes, height, config);
+    stage_timer_start(&timer);
+    flush_pending_page(&pending, config);
+    stage_timer_mark(&timer, STAGE_WRITE);
+    stage_timer_finish(&timer);
+    retained_page_free(&config->retained);
 
-        free(raster_buffer);
-        free(mono_buffer);
+    if (pool == &job_pool)
+    {
+        if (pool->allocations_saved > 0)
+            fprintf(stderr, "DEBUG: Buffer pool saved %ld allocations (%ld made).\n", pool->allocations_saved, pool->allocations);
+        pool_free(pool);
     }
 }
 
-// Set print options based on PPD defaults and user choices
-void set_pstops_options(print_job_config_t *config, int num_options, cups_option_t *options, const char *ppd_file)
+// Dither, mirror and rotate one page of raster into the pool's POOL_MONO
+// buffer, which 'page' then describes. 'raster_data' is turned into gray in
+// place. Returns -1, with the error logged, when memory runs out.
+int convert_raster_page(const cups_page_header2_t *header, unsigned char *raster_data, print_job_config_t *config,
+                        buffer_pool_t *pool, stage_timer_t *timer, mono_page_t *page)
 {
-    // In a real scenario, we would parse the PPD file here.
-    // For this reconstruction, we'll rely on the command-line options.
-    const char *val;
+    unsigned width, height;
+    int scaled = raster_scaled_size(header, &width, &height);
 
-    if ((val = cupsGetOption("Darkness", num_options, options)))
-        config->darkness = atoi(val);
-    if ((val = cupsGetOption("PrintSpeed", num_options, options)))
-        config->speed = atoi(val);
-    if ((val = cupsGetOption("MediaType", num_options, options)))
-        config->mediaType = atoi(val);
-    if ((val = cupsGetOption("Rotate", num_options, options)))
-        config->rotate = atoi(val);
-    if ((val = cupsGetOption("PrintMode", num_options, options)))
-        config->print_mode = atoi(val);
-    if ((val = cupsGetOption("Horizontal", num_options, options)))
-        config->horizontal_offset = atoi(val);
-    if ((val = cupsGetOption("Vertical", num_options, options)))
-        config->vertical_offset = atoi(val);
-    if ((val = cupsGetOption("GapHeight", num_options, options)))
-        config->gap_height = atoi(val);
-    if ((val = cupsGetOption("GapOffset", num_options, options)))
-        config->gap_offset = atoi(val);
-    if ((val = cupsGetOption("GD41Mirror", num_options, options)))
-        config->mirrorImage = atoi(val);
-    if ((val = cupsGetOption("GD41Negative", num_options, options)))
-        config->negativeImage = atoi(val);
+    unsigned mono_width_bytes = (width + 7) / 8;
+    size_t mono_size = (size_t)mono_width_bytes * height;
+    unsigned char *mono_buffer = pool_get(pool, POOL_MONO, mono_size);
+    if (!mono_buffer)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for monochrome buffer.\n");
+        return -1;
+    }
 
-    if ((val = cupsGetOption("PageSize", num_options, options)))
+    if (raster_is_bilevel(header))
     {
-        if (strncmp(val, "Custom", 6) == 0)
+        // Already black and white, only the polarity may need flipping
+        copy_bilevel_rows(raster_data, header->cupsBytesPerLine, mono_buffer, width, height,
+                          (header->cupsColorSpace == CUPS_CSPACE_K) != (config->negativeImage != 0));
+    }
+    else
+    {
+        dither_state_t *dither = pool_dither(pool, width, config->print_mode, config->dither_threads);
+        if (!dither)
         {
-            sscanf(val, "Custom.%dx%d", &config->page_width_mm, &config->page_height_mm);
-            // Convert from points to mm
-            config->page_width_mm = (int)(config->page_width_mm / 2.835);
-            config->page_height_mm = (int)(config->page_height_mm / 2.835);
+            fprintf(stderr, "ERROR: Unable to allocate memory for dithering.\n");
+            return -1;
         }
-        else if (sscanf(val, "w%dh%d", &config->page_width_mm, &config->page_height_mm) == 2)
+        dither_set_tone(dither, config);
+        raster_to_gray(header, raster_data, header->cupsHeight);
+        if (scaled && downscale_page(raster_data, header->cupsWidth, header->cupsHeight, width, height) < 0)
         {
-            // Convert from points to mm
-            config->page_width_mm = (int)(config->page_width_mm / 2.835);
-            config->page_height_mm = (int)(config->page_height_mm / 2.835);
+            fprintf(stderr, "ERROR: Unable to allocate memory for downscaling.\n");
+            return -1;
         }
+        dither_rows(dither, raster_data, mono_buffer, height);
     }
-}
+    stage_timer_mark(timer, STAGE_DITHER);
+    apply_image_manipulations(mono_buffer, width, height, config);
 
-// Apply transformations like rotate, mirror, negative to the bitmap
-void apply_image_manipulations(unsigned char *bitmap, unsigned *width, unsigned *height, print_job_config_t *config)
-{
-    if (config->negativeImage)
+    // Rotate the packed page, which is 8x smaller than the gray one
+    if (config->rotate == 1 || config->rotate == 2 || config->rotate == 3)
     {
-        for (unsigned i = 0; i < (*width) * (*height); ++i)
+        size_t rotated_size = config->rotate == 1 ? mono_size : ((size_t)height + 7) / 8 * width;
+        unsigned char *rotated = pool_get(pool, POOL_ROTATED, rotated_size);
+        if (!rotated)
         {
-            bitmap[i] = 255 - bitmap[i];
+            fprintf(stderr, "ERROR: Unable to allocate memory for rotation.\n");
+            return -1;
         }
-    }
+        rotate_mono(mono_buffer, rotated, width, height, config->rotate);
+        pool_swap(pool, POOL_MONO, POOL_ROTATED);
+        mono_buffer = rotated;
 
-    if (config->mirrorImage)
-    {
-        for (unsigned y = 0; y < *height; ++y)
+        if (config->rotate != 1)
         {
-            for (unsigned x = 0; x < *width / 2; ++x)
-            {
-                unsigned char temp = bitmap[y * (*width) + x];
-                bitmap[y * (*width) + x] = bitmap[y * (*width) + (*width - 1 - x)];
-                bitmap[y * (*width) + (*width - 1 - x)] = temp;
-            }
+            unsigned rotated_width = height;
+            height = width;
+            width = rotated_width;
+            mono_width_bytes = (width + 7) / 8;
+            mono_size = (size_t)mono_width_bytes * height;
         }
     }
+    stage_timer_mark(timer, STAGE_MANIPULATE);
 
-    // Rotation is more complex and would require allocating a new buffer and swapping dimensions.
-    // This is a simplified placeholder.
-    if (config->rotate == 2)
-    { // 90 degrees
-        // A proper 90-degree rotation is a significant operation and is omitted for brevity.
-        // It would involve creating a new buffer with swapped width/height and remapping pixels.
-    }
+    page->data = mono_buffer;
+    page->width_bytes = mono_width_bytes;
+    page->height = height;
+    page->size = mono_size;
+    return 0;
 }
 
-// Convert 8-bit grayscale to 1-bit monochrome using error diffusion
-void convert_gray_to_mono(unsigned char *gray_data, unsigned char *mono_data, int width, int height, int print_mode)
+// Send a converted page, or hold it back while duplicate detection waits to
+// see whether the next page repeats it. 'page' must be in the pool's
+// POOL_MONO buffer.
+void write_mono_page(const mono_page_t *page, pending_page_t *pending, print_job_config_t *config, buffer_pool_t *pool)
 {
-    // We'll use Floyd-Steinberg error diffusion as it's a common and effective algorithm.
-    int *buffer = (int *)malloc(width * height * sizeof(int));
-    if (!buffer)
+    if (!config->collapse_duplicates)
+    {
+        send_printer_commands(page->data, page->width_bytes, page->height, config->copies, config);
         return;
+    }
 
-    for (int i = 0; i < width * height; ++i)
+    uint64_t hash = page_hash(page->data, page->size);
+    if (pending->mono_data && pending->hash == hash && pending->width_bytes == (int)page->width_bytes &&
+        pending->height == (int)page->height && memcmp(pending->mono_data, page->data, page->size) == 0)
     {
-        buffer[i] = gray_data[i];
+        pending->count++;
+        return;
     }
 
-    error_diffusion(buffer, width, height);
-
-    // *** MODIFICATION FOR INVERTED PRINTING ***
-    // Initialize the monochrome buffer to all 1s (white for thermal printers)
-    memset(mono_data, 0xFF, ((width + 7) / 8) * height);
+    // The new page becomes the pending one, and the old pending buffer is
+    // recycled for the next page
+    flush_pending_page(pending, config);
+    pool_swap(pool, POOL_MONO, POOL_PENDING);
+    pending->mono_data = pool->buffers[POOL_PENDING];
+    pending->width_bytes = page->width_bytes;
+    pending->height = page->height;
+    pending->hash = hash;
+    pending->count = 1;
+}
 
-    for (int y = 0; y < height; ++y)
+// Return the buffer in 'slot', growing it to at least 'size' bytes. The old
+// contents are not kept when it grows.
+unsigned char *pool_get(buffer_pool_t *pool, int slot, size_t size)
+{
+    if (pool->buffers[slot] && pool->sizes[slot] >= size)
     {
-        for (int x = 0; x < width; ++x)
-        {
-            if (buffer[y * width + x] < 128)
-            {
-                // Clear the bit to 0 for black pixels
-                mono_data[y * ((width + 7) / 8) + (x / 8)] &= ~(1 << (7 - (x % 8)));
-            }
-        }
+        pool->allocations_saved++;
+        return pool->buffers[slot];
     }
 
-    free(buffer);
+    free(pool->buffers[slot]);
+    pool->buffers[slot] = malloc(size);
+    pool->sizes[slot] = pool->buffers[slot] ? size : 0;
+    pool->allocations++;
+    return pool->buffers[slot];
 }
 
-// Floyd-Steinberg error diffusion
-void error_diffusion(int *input_data, int width, int height)
+void pool_swap(buffer_pool_t *pool, int slot_a, int slot_b)
 {
-    for (int y = 0; y < height; y++)
+    unsigned char *buffer = pool->buffers[slot_a];
+    size_t size = pool->sizes[slot_a];
+    pool->buffers[slot_a] = pool->buffers[slot_b];
+    pool->sizes[slot_a] = pool->sizes[slot_b];
+    pool->buffers[slot_b] = buffer;
+    pool->sizes[slot_b] = size;
+}
+
+// Return a dither state for a new page, restarting the previous page's state
+// when the width and algorithm are unchanged
+dither_state_t *pool_dither(buffer_pool_t *pool, int width, int print_mode, int threads)
+{
+    if (pool->dither_ready && pool->dither.width == width && pool->dither.print_mode == print_mode)
     {
-        for (int x = 0; x < width; x++)
-        {
-            int old_pixel = input_data[y * width + x];
-            int new_pixel = (old_pixel < 128) ? 0 : 255;
-            input_data[y * width + x] = new_pixel;
+        dither_restart(&pool->dither);
+        pool->dither.threads = threads;
+        pool->allocations_saved += 4;
+        return &pool->dither;
+    }
 
-            int quant_error = old_pixel - new_pixel;
+    if (pool->dither_ready)
+        dither_free(&pool->dither);
+    pool->dither_ready = dither_init(&pool->dither, width, print_mode, threads) == 0;
+    pool->allocations += 4;
+    return pool->dither_ready ? &pool->dither : NULL;
+}
 
-            if (x + 1 < width)
-                input_data[y * width + (x + 1)] += quant_error * 7 / 16;
-            if (x - 1 >= 0 && y + 1 < height)
-                input_data[(y + 1) * width + (x - 1)] += quant_error * 3 / 16;
-            if (y + 1 < height)
-                input_data[(y + 1) * width + x] += quant_error * 5 / 16;
-            if (x + 1 < width && y + 1 < height)
-                input_data[(y + 1) * width + (x + 1)] += quant_error * 1 / 16;
-        }
+void pool_free(buffer_pool_t *pool)
+{
+    for (int i = 0; i < POOL_SLOTS; ++i)
+    {
+        free(pool->buffers[i]);
+        pool->buffers[i] = NULL;
+        pool->sizes[i] = 0;
     }
+    if (pool->dither_ready)
+        dither_free(&pool->dither);
+    pool->dither_ready = 0;
 }
 
-// Send the final commands and bitmap data to the printer
-void send_printer_commands(unsigned char *mono_data, int width_bytes, int height_pixels, print_job_config_t *config)
-{
-    printf("SIZE %d mm,%d mm\r\n", config->page_width_mm, config->page_height_mm);
-    printf("GAP %d mm,%d mm\r\n", config->gap_height, config->gap_offset);
-    printf("DIRECTION 0,0\r\n");
-    printf("REFERENCE %d,%d\r\n", config->horizontal_offset, config->vertical_offset);
-    printf("DENSITY %d\r\n", config->darkness);
-    printf("SPEED %d\r\n", config->speed);
-    printf("CLS\r\n");
-    printf("BITMAP 0,0,%d,%d,1,", width_bytes, height_pixels);
-    fflush(stdout);
-
-    write(STDOUT_FILENO, mono_data, width_bytes * height_pixels);
-
-    printf("\r\nPRINT 1,%d\r\n", config->copies);
-    fflush(stdout);
-}
\ No newline at end of file
+static const char *stage_names[STAGE_COUNT] = {"header", "read", "dither", "manipulate", "write"};
+
+static double stage_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void stage_timer_init(stage_timer_t *timer, int enabled)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->enabled = enabled;
+    if (enabled)
+        timer->job_start = stage_clock();
+}
+
+// Start timing a stage, time spent since the last mark is dropped
+void stage_timer_start(stage_timer_t *timer)
+{
+    if (timer->enabled)
+        timer->mark = stage_clock();
+}
+
+// Charge the time since the last mark or start to 'stage'
+void stage_timer_mark(stage_timer_t *timer, int stage)
+{
+    if (!timer->enabled)
+        return;
+
+    double now = stage_clock();
+    timer->page_seconds[stage] += now - timer->mark;
+    timer->mark = now;
+}
+
+// Print the times of one page or of the whole job
+static void stage_timer_report(const char *what, const double *seconds, long page_bytes, long bitmap_bytes)
+{
+    char times[256];
+    int length = 0;
+    for (int i = 0; i < STAGE_COUNT; ++i)
+    {
+        length += snprintf(times + length, sizeof(times) - length, "%s%s %.3f", i ? ", " : "", stage_names[i], seconds[i] * 1000.0);
+    }
+
+    long skipped = page_bytes > bitmap_bytes ? page_bytes - bitmap_bytes : 0;
+    fprintf(stderr, "DEBUG: %s times (ms): %s; bitmap bytes %ld sent, %ld skipped.\n", what, times, bitmap_bytes, skipped);
+}
+
+static void stage_timer_end_page(stage_timer_t *timer)
+{
+    if (timer->page == 0)
+        return;
+
+    char what[32];
+    snprintf(what, sizeof(what), "Page %d", timer->page);
+    stage_timer_report(what, timer->page_seconds, output_stats.page_bytes - timer->page_start.page_bytes,
+                       output_stats.bitmap_bytes - timer->page_start.bitmap_bytes);
+    for (int i = 0; i < STAGE_COUNT; ++i)
+    {
+        timer->job_seconds[i] += timer->page_seconds[i];
+        timer->page_seconds[i] = 0;
+    }
+}
+
+// A new page header was read: report the previous page and start this one
+void stage_timer_page(stage_timer_t *timer)
+{
+    if (!timer->enabled)
+        return;
+
+    stage_timer_end_page(timer);
+    timer->page++;
+    timer->page_start = output_stats;
+}
+
+static void stage_timer_report_rss(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stderr, "DEBUG: Job peak RSS %ld KiB.\n", usage.ru_maxrss);
+}
+
+// Report the last page and the totals for the job, with the peak memory use
+// an end-to-end benchmark can collect from the filter log
+void stage_timer_finish(stage_timer_t *timer)
+{
+    if (!timer->enabled)
+        return;
+
+    stage_timer_end_page(timer);
+    stage_timer_report("Job", timer->job_seconds, output_stats.page_bytes, output_stats.bitmap_bytes);
+    stage_timer_report_rss();
+}
+
+// Report a job whose stages overlap on several threads. Per-stage times would
+// be meaningless, so only the wall time of the whole job is given.
+void stage_timer_finish_overlapped(stage_timer_t *timer)
+{
+    if (!timer->enabled)
+        return;
+
+    long skipped = output_stats.page_bytes > output_stats.bitmap_bytes ? output_stats.page_bytes - output_stats.bitmap_bytes : 0;
+    fprintf(stderr, "DEBUG: Job wall time (ms): %.3f, stages overlapped; bitmap bytes %ld sent, %ld skipped.\n",
+            (stage_clock() - timer->job_start) * 1000.0, output_stats.bitmap_bytes, skipped);
+    stage_timer_report_rss();
+}
+
+// Rotation, duplicate detection, form caching and differential updates look
+// at the whole packed page, everything else works line by line
+int page_needs_whole_buffer(const print_job_config_t *config)
+{
+    return config->rotate != 0 || config->collapse_duplicates || config->form_cache || config->differential;
+}
+
+// True when a banded page is sent under one BITMAP header for the whole page,
+// rather than as a BITMAP per band or per inked rectangle
+int page_has_bitmap_header(const print_job_config_t *config)
+{
+    return !config->sparse_bitmap && !config->banded_bitmap;
+}
+
+// 64-bit FNV-1a over whole words, used to spot repeated pages cheaply before
+// the full compare
+uint64_t page_hash(const unsigned char *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < length; ++i)
+    {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Send the held back page once, printing it for every repeat that was folded
+// into it. The buffer belongs to the caller.
+void flush_pending_page(pending_page_t *pending, print_job_config_t *config)
+{
+    if (!pending->mono_data)
+        return;
+
+    if (pending->count > 1)
+        fprintf(stderr, "DEBUG: Folded %d identical pages into one bitmap.\n", pending->count);
+
+    send_printer_commands(pending->mono_data, pending->width_bytes, pending->height, config->copies * pending->count, config);
+    pending->mono_data = NULL;
+    pending->count = 0;
+}
+
+// Stream a page through the pipeline in bands of config->band_height lines.
+// The dither state carries error from the bottom of one band into the next,
+// so the output matches the whole-page path.
+int process_raster_bands(cups_raster_t *raster, cups_page_header2_t *header, print_job_config_t *config, buffer_pool_t *pool,
+                         stage_timer_t *timer)
+{
+    unsigned in_height = header->cupsHeight;
+    unsigned band_lines = (unsigned)config->band_height < in_height ? (unsigned)config->band_height : in_height;
+    unsigned width, height;
+    int scaled = raster_scaled_size(header, &width, &height);
+    unsigned mono_width_bytes = (width + 7) / 8;
+
+    // A scaled band is never taller than the input band it comes from
+    downscale_t scale = {0};
+    unsigned char *raster_band = pool_get(pool, POOL_RASTER, (size_t)band_lines * header->cupsBytesPerLine);
+    unsigned char *mono_band = pool_get(pool, POOL_MONO, (size_t)mono_width_bytes * band_lines);
+    dither_state_t *dither = pool_dither(pool, width, config->print_mode, config->dither_threads);
+    if (!raster_band || !mono_band || !dither ||
+        (scaled && downscale_init(&scale, header->cupsWidth, in_height, width, height) < 0))
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for raster band.\n");
+        return -1;
+    }
+    dither_set_tone(dither, config);
+    int bilevel = raster_is_bilevel(header);
+    int invert = (header->cupsColorSpace == CUPS_CSPACE_K) != (config->negativeImage != 0);
+
+    begin_band_page(config, mono_width_bytes, height);
+    stage_timer_mark(timer, STAGE_WRITE);
+
+    int status = 0;
+    int bitmaps_sent = 0;
+    unsigned out_y = 0;
+    for (unsigned y = 0; y < in_height; y += band_lines)
+    {
+        unsigned rows = (in_height - y < band_lines) ? in_height - y : band_lines;
+
+        if (cupsRasterReadPixels(raster, raster_band, rows * header->cupsBytesPerLine) == 0)
+        {
+            fprintf(stderr, "ERROR: Failed to read raster pixels.\n");
+            status = -1;
+            if (!page_has_bitmap_header(config))
+                break;
+
+            // The BITMAP size is already on the wire, pad it out with white
+            memset(mono_band, 0xFF, mono_width_bytes * band_lines);
+            for (; out_y < height; out_y += rows)
+            {
+                rows = (height - out_y < band_lines) ? height - out_y : band_lines;
+                output_data(mono_band, mono_width_bytes * rows);
+                output_stats.bitmap_bytes += mono_width_bytes * rows;
+            }
+            output_flush();
+            break;
+        }
+        stage_timer_mark(timer, STAGE_READ);
+
+        if (bilevel)
+        {
+            copy_bilevel_rows(raster_band, header->cupsBytesPerLine, mono_band, width, rows, invert);
+        }
+        else
+        {
+            raster_to_gray(header, raster_band, rows);
+            if (scaled)
+                rows = downscale_rows(&scale, raster_band, raster_band, rows);
+            if (rows > 0)
+                dither_rows(dither, raster_band, mono_band, rows);
+        }
+        stage_timer_mark(timer, STAGE_DITHER);
+        if (rows == 0)
+            continue; // Not enough lines in yet for a scaled one
+        apply_image_manipulations(mono_band, width, rows, config);
+        stage_timer_mark(timer, STAGE_MANIPULATE);
+        bitmaps_sent = send_band(config, mono_band, mono_width_bytes, rows, out_y, bitmaps_sent);
+        out_y += rows;
+        stage_timer_mark(timer, STAGE_WRITE);
+    }
+
+    downscale_free(&scale);
+    send_page_trailer(config->copies);
+    stage_timer_mark(timer, STAGE_WRITE);
+    return status;
+}
+
+void band_queue_init(band_queue_t *queue)
+{
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+void band_queue_destroy(band_queue_t *queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+// Append a band, waiting while the queue is full
+void band_queue_push(band_queue_t *queue, band_t *band)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == PIPELINE_BANDS)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->slots[(queue->head + queue->count) % PIPELINE_BANDS] = band;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take the oldest band, waiting while the queue is empty
+band_t *band_queue_pop(band_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    band_t *band = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % PIPELINE_BANDS;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return band;
+}
+
+// Middle stage: image manipulation, dithering and packing
+static void *pipeline_processor(void *arg)
+{
+    pipeline_t *pipe = arg;
+    print_job_config_t *config = pipe->config;
+    dither_state_t dither = {0};
+    int dither_ok = 0;
+    downscale_t scale = {0};
+    int scaled = 0;
+    unsigned width = 0, height = 0;
+
+    for (;;)
+    {
+        band_t *band = band_queue_pop(&pipe->read_bands);
+        if (band->end)
+        {
+            band_queue_push(&pipe->done_bands, band);
+            break;
+        }
+
+        if (band->first)
+        {
+            scaled = raster_scaled_size(&band->header, &width, &height);
+            dither_free(&dither);
+            downscale_free(&scale);
+            dither_ok = dither_init(&dither, width, config->print_mode, config->dither_threads) == 0 &&
+                        (!scaled || downscale_init(&scale, band->header.cupsWidth, band->header.cupsHeight, width, height) == 0);
+            if (dither_ok)
+                dither_set_tone(&dither, config);
+            else
+                fprintf(stderr, "ERROR: Unable to allocate memory for dithering.\n");
+        }
+        unsigned mono_width_bytes = (width + 7) / 8;
+
+        // Printed lines the band completes: output line n is done once the
+        // input reaches (n + 1) * cupsHeight / height
+        unsigned out_y = band->y;
+        unsigned out_rows = band->rows;
+        if (scaled)
+        {
+            out_y = (unsigned)((uint64_t)band->y * height / band->header.cupsHeight);
+            out_rows = (unsigned)((uint64_t)(band->y + band->rows) * height / band->header.cupsHeight) - out_y;
+        }
+
+        size_t mono_size = (size_t)mono_width_bytes * band->rows;
+        if (band->mono_size < mono_size)
+        {
+            free(band->mono);
+            band->mono = malloc(mono_size);
+            band->mono_size = band->mono ? mono_size : 0;
+        }
+
+        // The writer still needs the band to keep the BITMAP size honest,
+        // so a failure here turns into white lines
+        if (!band->mono)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for monochrome buffer.\n");
+            band->blank = 1;
+        }
+        else if (band->blank || (!dither_ok && !raster_is_bilevel(&band->header)))
+        {
+            memset(band->mono, 0xFF, mono_size);
+        }
+        else
+        {
+            if (raster_is_bilevel(&band->header))
+                copy_bilevel_rows(band->gray, band->header.cupsBytesPerLine, band->mono, width, band->rows,
+                                  (band->header.cupsColorSpace == CUPS_CSPACE_K) != (config->negativeImage != 0));
+            else
+            {
+                raster_to_gray(&band->header, band->gray, band->rows);
+                if (scaled)
+                    downscale_rows(&scale, band->gray, band->gray, band->rows);
+                if (out_rows > 0)
+                    dither_rows(&dither, band->gray, band->mono, out_rows);
+            }
+            apply_image_manipulations(band->mono, width, out_rows, config);
+        }
+
+        // The writer sends the band at its printed size
+        band->y = out_y;
+        band->rows = out_rows;
+        band->header.cupsWidth = width;
+        band->header.cupsHeight = height;
+        band_queue_push(&pipe->done_bands, band);
+    }
+
+    dither_free(&dither);
+    downscale_free(&scale);
+    return NULL;
+}
+
+// Last stage: TSPL output, the only thread that touches stdout
+static void *pipeline_writer(void *arg)
+{
+    pipeline_t *pipe = arg;
+    print_job_config_t *config = pipe->config;
+    int bitmaps_sent = 0;
+
+    for (;;)
+    {
+        band_t *band = band_queue_pop(&pipe->done_bands);
+        if (band->end)
+            break;
+
+        int mono_width_bytes = (band->header.cupsWidth + 7) / 8;
+        if (band->first)
+        {
+            begin_band_page(config, mono_width_bytes, band->header.cupsHeight);
+            bitmaps_sent = 0;
+        }
+
+        if (band->rows == 0)
+        {
+            // Downscaled to nothing, its lines are part of the next band
+        }
+        else if (band->mono)
+        {
+            bitmaps_sent = send_band(config, band->mono, mono_width_bytes, band->rows, band->y, bitmaps_sent);
+        }
+        else if (page_has_bitmap_header(config))
+        {
+            // No buffer at all, pad the BITMAP line by line
+            unsigned char white[64];
+            memset(white, 0xFF, sizeof(white));
+            for (size_t left = (size_t)mono_width_bytes * band->rows; left > 0;)
+            {
+                size_t chunk = left < sizeof(white) ? left : sizeof(white);
+                output_data(white, chunk);
+                output_stats.bitmap_bytes += chunk;
+                left -= chunk;
+            }
+            output_flush();
+        }
+
+        if (band->last)
+            send_page_trailer(config->copies);
+
+        band_queue_push(&pipe->free_bands, band);
+    }
+    return NULL;
+}
+
+// Read the raster on the calling thread while a processor thread dithers and
+// a writer thread sends TSPL, connected by queues of a few bands each. The
+// USB transfer of one band or page then overlaps reading and dithering the
+// next, and memory stays bounded by PIPELINE_BANDS bands.
+void process_raster_pipelined(cups_raster_t *raster, print_job_config_t *config)
+{
+    pipeline_t pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.config = config;
+    band_queue_init(&pipe.free_bands);
+    band_queue_init(&pipe.read_bands);
+    band_queue_init(&pipe.done_bands);
+    for (int i = 0; i < PIPELINE_BANDS; ++i)
+    {
+        band_queue_push(&pipe.free_bands, pipe.bands + i);
+    }
+
+    pthread_t processor, writer;
+    if (pthread_create(&processor, NULL, pipeline_processor, &pipe) != 0)
+    {
+        fprintf(stderr, "ERROR: Unable to start pipeline threads.\n");
+        return;
+    }
+    if (pthread_create(&writer, NULL, pipeline_writer, &pipe) != 0)
+    {
+        fprintf(stderr, "ERROR: Unable to start pipeline threads.\n");
+        band_t *band = band_queue_pop(&pipe.free_bands);
+        band->end = 1;
+        band_queue_push(&pipe.read_bands, band);
+        pthread_join(processor, NULL);
+        return;
+    }
+
+    unsigned band_lines = config->band_height > 0 ? (unsigned)config->band_height : PIPELINE_BAND_HEIGHT;
+    cups_page_header2_t header;
+    int failed = 0;
+
+    while (!failed && cupsRasterReadHeader2(raster, &header))
+    {
+        if (header.cupsWidth == 0 || header.cupsHeight == 0 || header.cupsBytesPerLine == 0)
+            continue;
+        if (!raster_is_supported(&header))
+        {
+            fprintf(stderr, "ERROR: Skipping a page with %u bits per pixel in color space %d.\n", header.cupsBitsPerPixel,
+                    header.cupsColorSpace);
+            failed = skip_raster_page(raster, &header) < 0;
+            continue;
+        }
+
+        for (unsigned y = 0; y < header.cupsHeight; y += band_lines)
+        {
+            band_t *band = band_queue_pop(&pipe.free_bands);
+            band->header = header;
+            band->y = y;
+            band->rows = (header.cupsHeight - y < band_lines) ? header.cupsHeight - y : band_lines;
+            band->first = y == 0;
+            band->last = y + band->rows == header.cupsHeight;
+            band->blank = failed;
+
+            size_t gray_size = (size_t)band->rows * header.cupsBytesPerLine;
+            if (!failed && band->gray_size < gray_size)
+            {
+                free(band->gray);
+                band->gray = malloc(gray_size);
+                band->gray_size = band->gray ? gray_size : 0;
+                if (!band->gray)
+                {
+                    fprintf(stderr, "ERROR: Unable to allocate memory for raster band.\n");
+                    failed = band->blank = 1;
+                }
+            }
+
+            // Once reading fails the rest of the page still goes out, as white
+            if (!failed && cupsRasterReadPixels(raster, band->gray, gray_size) == 0)
+            {
+                fprintf(stderr, "ERROR: Failed to read raster pixels.\n");
+                failed = band->blank = 1;
+            }
+
+            band_queue_push(&pipe.read_bands, band);
+        }
+    }
+
+    band_t *band = band_queue_pop(&pipe.free_bands);
+    band->end = 1;
+    band_queue_push(&pipe.read_bands, band);
+
+    pthread_join(processor, NULL);
+    pthread_join(writer, NULL);
+
+    for (int i = 0; i < PIPELINE_BANDS; ++i)
+    {
+        free(pipe.bands[i].gray);
+        free(pipe.bands[i].mono);
+    }
+    band_queue_destroy(&pipe.free_bands);
+    band_queue_destroy(&pipe.read_bands);
+    band_queue_destroy(&pipe.done_bands);
+}
+
+static void swap_buffers(unsigned char **a, size_t *a_size, unsigned char **b, size_t *b_size)
+{
+    unsigned char *buffer = *a;
+    size_t size = *a_size;
+    *a = *b;
+    *a_size = *b_size;
+    *b = buffer;
+    *b_size = size;
+}
+
+// Page worker: take the next page read, convert it with this thread's own
+// pool and hand it to the writer
+static void *page_worker(void *arg)
+{
+    page_workers_t *workers = arg;
+    buffer_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    stage_timer_t timer;
+    stage_timer_init(&timer, 0);
+
+    pthread_mutex_lock(&workers->lock);
+    for (;;)
+    {
+        page_slot_t *slot = workers->slots + workers->next_convert % workers->in_flight;
+        while (slot->state != PAGE_SLOT_READ)
+        {
+            pthread_cond_wait(&workers->changed, &workers->lock);
+            slot = workers->slots + workers->next_convert % workers->in_flight;
+        }
+        if (slot->end)
+            break;
+        workers->next_convert++;
+        slot->state = PAGE_SLOT_CONVERTING;
+        pthread_mutex_unlock(&workers->lock);
+
+        slot->failed = convert_raster_page(&slot->header, slot->raster, workers->config, &pool, &timer, &slot->page) < 0;
+        if (!slot->failed)
+        {
+            swap_buffers(&slot->mono, &slot->mono_size, &pool.buffers[POOL_MONO], &pool.sizes[POOL_MONO]);
+            slot->page.data = slot->mono;
+        }
+
+        pthread_mutex_lock(&workers->lock);
+        slot->state = PAGE_SLOT_DONE;
+        pthread_cond_broadcast(&workers->changed);
+    }
+    pthread_mutex_unlock(&workers->lock);
+
+    pool_free(&pool);
+    return NULL;
+}
+
+// Page writer: send the converted pages in page order, the only thread that
+// touches stdout
+static void *page_writer(void *arg)
+{
+    page_workers_t *workers = arg;
+    print_job_config_t *config = workers->config;
+    pending_page_t pending = {0};
+    buffer_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+
+    for (long next = 0;; ++next)
+    {
+        page_slot_t *slot = workers->slots + next % workers->in_flight;
+        pthread_mutex_lock(&workers->lock);
+        while (slot->state != PAGE_SLOT_DONE && !(slot->state == PAGE_SLOT_READ && slot->end))
+            pthread_cond_wait(&workers->changed, &workers->lock);
+        pthread_mutex_unlock(&workers->lock);
+        if (slot->end)
+            break;
+
+        if (!slot->failed)
+        {
+            // The page moves into this thread's pool, where duplicate
+            // detection can keep it
+            swap_buffers(&slot->mono, &slot->mono_size, &pool.buffers[POOL_MONO], &pool.sizes[POOL_MONO]);
+            slot->page.data = pool.buffers[POOL_MONO];
+            write_mono_page(&slot->page, &pending, config, &pool);
+        }
+
+        pthread_mutex_lock(&workers->lock);
+        slot->state = PAGE_SLOT_FREE;
+        pthread_cond_broadcast(&workers->changed);
+        pthread_mutex_unlock(&workers->lock);
+    }
+
+    flush_pending_page(&pending, config);
+    pool_free(&pool);
+    return NULL;
+}
+
+// Read whole pages on the calling thread and convert several at once on a
+// pool of config->page_threads workers, for jobs of many different labels.
+// A writer thread sends them in page order. At most pages_in_flight pages
+// are held between reading and sending, which bounds memory.
+void process_raster_parallel(cups_raster_t *raster, print_job_config_t *config)
+{
+    int threads = config->page_threads < PAGE_THREADS_MAX ? config->page_threads : PAGE_THREADS_MAX;
+    int in_flight = config->pages_in_flight > 0 ? config->pages_in_flight : 2 * threads;
+    if (in_flight > PAGES_IN_FLIGHT_MAX)
+        in_flight = PAGES_IN_FLIGHT_MAX;
+    if (in_flight < 2)
+        in_flight = 2;
+
+    page_workers_t workers;
+    memset(&workers, 0, sizeof(workers));
+    workers.config = config;
+    workers.in_flight = in_flight;
+    workers.slots = calloc(in_flight, sizeof(page_slot_t));
+    if (!workers.slots)
+    {
+        fprintf(stderr, "ERROR: Unable to allocate memory for page slots.\n");
+        return;
+    }
+    pthread_mutex_init(&workers.lock, NULL);
+    pthread_cond_init(&workers.changed, NULL);
+
+    pthread_t writer;
+    pthread_t worker_threads[PAGE_THREADS_MAX];
+    int started = 0;
+    int writer_started = pthread_create(&writer, NULL, page_writer, &workers) == 0;
+    while (writer_started && started < threads &&
+           pthread_create(worker_threads + started, NULL, page_worker, &workers) == 0)
+    {
+        started++;
+    }
+    if (!writer_started || started == 0)
+        fprintf(stderr, "ERROR: Unable to start page threads.\n");
+    else if (started < threads)
+        fprintf(stderr, "DEBUG: Converting pages on %d of %d threads.\n", started, threads);
+
+    cups_page_header2_t header;
+    long sequence = 0;
+    for (;;)
+    {
+        page_slot_t *slot = workers.slots + sequence % in_flight;
+        pthread_mutex_lock(&workers.lock);
+        while (slot->state != PAGE_SLOT_FREE)
+            pthread_cond_wait(&workers.changed, &workers.lock);
+        pthread_mutex_unlock(&workers.lock);
+
+        if (started == 0 || !cupsRasterReadHeader2(raster, &header))
+            break;
+        if (header.cupsWidth == 0 || header.cupsHeight == 0 || header.cupsBytesPerLine == 0)
+            continue;
+        if (!raster_is_supported(&header))
+        {
+            fprintf(stderr, "ERROR: Skipping a page with %u bits per pixel in color space %d.\n", header.cupsBitsPerPixel,
+                    header.cupsColorSpace);
+            if (skip_raster_page(raster, &header) < 0)
+                break;
+            continue;
+        }
+
+        size_t size = (size_t)header.cupsHeight * header.cupsBytesPerLine;
+        if (slot->raster_size < size)
+        {
+            free(slot->raster);
+            slot->raster = malloc(size);
+            slot->raster_size = slot->raster ? size : 0;
+        }
+        if (!slot->raster)
+        {
+            fprintf(stderr, "ERROR: Unable to allocate memory for raster page.\n");
+            break;
+        }
+        if (cupsRasterReadPixels(raster, slot->raster, size) == 0)
+        {
+            fprintf(stderr, "ERROR: Failed to read raster pixels.\n");
+            break;
+        }
+
+        slot->header = header;
+        pthread_mutex_lock(&workers.lock);
+        slot->state = PAGE_SLOT_READ;
+        pthread_cond_broadcast(&workers.changed);
+        pthread_mutex_unlock(&workers.lock);
+        sequence++;
+    }
+
+    // The slot after the last page tells the workers and the writer to stop
+    page_slot_t *slot = workers.slots + sequence % in_flight;
+    pthread_mutex_lock(&workers.lock);
+    slot->end = 1;
+    slot->state = PAGE_SLOT_READ;
+    pthread_cond_broadcast(&workers.changed);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(worker_threads[i], NULL);
+    }
+    if (writer_started)
+        pthread_join(writer, NULL);
+
+    for (int i = 0; i < in_flight; ++i)
+    {
+        free(workers.slots[i].raster);
+        free(workers.slots[i].mono);
+    }
+    free(workers.slots);
+    pthread_mutex_destroy(&workers.lock);
+    pthread_cond_destroy(&workers.changed);
+}
+
+// Settings used when neither the PPD nor the job says otherwise
+void set_default_options(print_job_config_t *config)
+{
+    config->speed = 4;
+    config->darkness = 12;
+    config->mediaType = 1;
+    config->gap_height = 3;
+    config->print_mode = PRINT_MODE_DEFAULT;
+    config->gamma = 100;
+    build_tone_curve(config);
+}
+
+// Set print options based on PPD defaults and user choices
+void set_pstops_options(print_job_config_t *config, int num_options, cups_option_t *options, const char *ppd_file)
+{
+    // In a real scenario, we would parse the PPD file here.
+    // For this reconstruction, we'll rely on the command-line options.
+    const char *val;
+
+    if ((val = cupsGetOption("Darkness", num_options, options)))
+        config->darkness = atoi(val);
+    if ((val = cupsGetOption("PrintSpeed", num_options, options)))
+        config->speed = atoi(val);
+    if ((val = cupsGetOption("MediaType", num_options, options)))
+        config->mediaType = atoi(val);
+    if ((val = cupsGetOption("Rotate", num_options, options)))
+        config->rotate = atoi(val);
+    if ((val = cupsGetOption("PrintMode", num_options, options)))
+        config->print_mode = atoi(val);
+    if ((val = cupsGetOption("Gamma", num_options, options)))
+        config->gamma = atoi(val);
+    if ((val = cupsGetOption("Contrast", num_options, options)))
+        config->contrast = atoi(val);
+    if ((val = cupsGetOption("Horizontal", num_options, options)))
+        config->horizontal_offset = atoi(val);
+    if ((val = cupsGetOption("Vertical", num_options, options)))
+        config->vertical_offset = atoi(val);
+    if ((val = cupsGetOption("GapHeight", num_options, options)))
+        config->gap_height = atoi(val);
+    if ((val = cupsGetOption("GapOffset", num_options, options)))
+        config->gap_offset = atoi(val);
+    if ((val = cupsGetOption("GD41Mirror", num_options, options)))
+        config->mirrorImage = atoi(val);
+    if ((val = cupsGetOption("GD41Negative", num_options, options)))
+        config->negativeImage = atoi(val);
+    if ((val = cupsGetOption("BandHeight", num_options, options)))
+        config->band_height = atoi(val);
+    if ((val = cupsGetOption("DitherThreads", num_options, options)))
+        config->dither_threads = atoi(val);
+    if ((val = cupsGetOption("PageThreads", num_options, options)))
+        config->page_threads = atoi(val);
+    if ((val = cupsGetOption("PagesInFlight", num_options, options)))
+        config->pages_in_flight = atoi(val);
+    if ((val = cupsGetOption("Pipeline", num_options, options)))
+        config->pipeline = atoi(val);
+    if ((val = cupsGetOption("BandedBitmap", num_options, options)))
+        config->banded_bitmap = atoi(val);
+    if ((val = cupsGetOption("SparseBitmap", num_options, options)))
+        config->sparse_bitmap = atoi(val);
+    if ((val = cupsGetOption("CollapseDuplicates", num_options, options)))
+        config->collapse_duplicates = atoi(val);
+    if ((val = cupsGetOption("DifferentialUpdate", num_options, options)))
+        config->differential = atoi(val);
+    if ((val = cupsGetOption("FormCache", num_options, options)))
+        config->form_cache = atoi(val);
+    if ((val = cupsGetOption("StatusPolling", num_options, options)))
+        config->status_polling = atoi(val);
+    if ((val = cupsGetOption("StageTiming", num_options, options)))
+        config->stage_timing = atoi(val);
+    if ((val = cupsGetOption("FormVariableArea", num_options, options)))
+    {
+        if (sscanf(val, "%d,%d,%d,%d", &config->form_area[0], &config->form_area[1], &config->form_area[2],
+                   &config->form_area[3]) != 4)
+            memset(config->form_area, 0, sizeof(config->form_area));
+    }
+
+    if ((val = cupsGetOption("PageSize", num_options, options)))
+    {
+        if (strncmp(val, "Custom", 6) == 0)
+        {
+            sscanf(val, "Custom.%dx%d", &config->page_width_mm, &config->page_height_mm);
+            // Convert from points to mm
+            config->page_width_mm = (int)(config->page_width_mm / 2.835);
+            config->page_height_mm = (int)(config->page_height_mm / 2.835);
+        }
+        else if (sscanf(val, "w%dh%d", &config->page_width_mm, &config->page_height_mm) == 2)
+        {
+            // Convert from points to mm
+            config->page_width_mm = (int)(config->page_width_mm / 2.835);
+            config->page_height_mm = (int)(config->page_height_mm / 2.835);
+        }
+    }
+
+    build_tone_curve(config);
+}
+
+// Build the job's gray remap, applied while dithering so it costs one table
+// lookup per pixel. Darkening midtones here lets a lower Darkness and a
+// faster PrintSpeed give the same visual result, the printhead no longer has
+// to make up for light gray. Solid black and white stay where they are, so
+// text and barcodes are not affected.
+void build_tone_curve(print_job_config_t *config)
+{
+    double exponent = config->gamma > 0 ? config->gamma / 100.0 : 1.0;
+    double slope = (100 + config->contrast) / 100.0;
+    if (slope < 0)
+        slope = 0;
+
+    config->tone_identity = 1;
+    for (int i = 0; i < 256; ++i)
+    {
+        double level = config->negativeImage ? 255 - i : i;
+        level = 127.5 + (level - 127.5) * slope;
+        if (level < 0)
+            level = 0;
+        if (level > 255)
+            level = 255;
+        level = 255.0 * pow(level / 255.0, exponent);
+
+        config->tone[i] = (unsigned char)(level + 0.5);
+        if (config->tone[i] != i)
+            config->tone_identity = 0;
+    }
+}
+
+// Apply transformations to packed lines after dithering. Negative is folded
+// into the dither state's tone table and rotation needs the whole page, see
+// rotate_mono().
+void apply_image_manipulations(unsigned char *mono_data, int width, int rows, print_job_config_t *config)
+{
+    if (config->mirrorImage)
+    {
+        int width_bytes = (width + 7) / 8;
+        for (int y = 0; y < rows; ++y)
+        {
+            mirror_mono_row(mono_data + (size_t)y * width_bytes, width);
+        }
+    }
+}
+
+// True for 1-bit raster, which skips dithering
+int raster_is_bilevel(const cups_page_header2_t *header)
+{
+    return header->cupsBitsPerColor == 1 && header->cupsBitsPerPixel == 1;
+}
+
+// True for the layouts the filter prints: 1-bit, and 8-bit gray, black or
+// RGB, which is what CUPS, PWG and Apple raster clients send a mono printer
+int raster_is_supported(const cups_page_header2_t *header)
+{
+    if (raster_is_bilevel(header))
+        return 1;
+    if (header->cupsBitsPerColor != 8)
+        return 0;
+    if (header->cupsBitsPerPixel == 8)
+        return 1;
+    return header->cupsBitsPerPixel == 24 &&
+           (header->cupsColorSpace == CUPS_CSPACE_RGB || header->cupsColorSpace == CUPS_CSPACE_SRGB ||
+            header->cupsColorSpace == CUPS_CSPACE_ADOBERGB);
+}
+
+// Turn 8-bit raster lines into the gray lines, 'cupsWidth' apart, that the
+// dither reads. Done in place, every output byte lands at or before the
+// input it comes from, so RGB pages from driverless clients need no second
+// buffer. Gray with no line padding is left alone.
+void raster_to_gray(const cups_page_header2_t *header, unsigned char *raster_data, int rows)
+{
+    unsigned width = header->cupsWidth;
+    unsigned bytes_per_line = header->cupsBytesPerLine;
+
+    if (header->cupsBitsPerPixel == 24)
+    {
+        for (int y = 0; y < rows; ++y)
+        {
+            const unsigned char *rgb = raster_data + (size_t)y * bytes_per_line;
+            unsigned char *gray = raster_data + (size_t)y * width;
+            for (unsigned x = 0; x < width; ++x, rgb += 3)
+            {
+                gray[x] = (unsigned char)((rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8);
+            }
+        }
+        return;
+    }
+
+    if (bytes_per_line != width)
+    {
+        for (int y = 1; y < rows; ++y)
+        {
+            memmove(raster_data + (size_t)y * width, raster_data + (size_t)y * bytes_per_line, width);
+        }
+    }
+
+    // Black is ink coverage, 0 is white
+    if (header->cupsColorSpace == CUPS_CSPACE_K)
+    {
+        size_t size = (size_t)width * rows;
+        for (size_t i = 0; i < size; ++i)
+        {
+            raster_data[i] = (unsigned char)~raster_data[i];
+        }
+    }
+}
+
+// Read past the pixels of a page that is not printed. Returns -1 when the
+// stream ends early.
+int skip_raster_page(cups_raster_t *raster, const cups_page_header2_t *header)
+{
+    unsigned char *line = malloc(header->cupsBytesPerLine);
+    if (!line)
+        return -1;
+
+    int status = 0;
+    for (unsigned y = 0; y < header->cupsHeight; ++y)
+    {
+        if (cupsRasterReadPixels(raster, line, header->cupsBytesPerLine) == 0)
+        {
+            status = -1;
+            break;
+        }
+    }
+    free(line);
+    return status;
+}
+
+// Size of a page at PRINTER_DPI. Returns 1 when it is smaller than the
+// page as rendered and has to be downscaled. Coarser raster is printed as it
+// is, one pixel per dot, as it always was.
+int downscale_size(unsigned width, unsigned height, const unsigned resolution[2], unsigned *out_width, unsigned *out_height)
+{
+    *out_width = width;
+    *out_height = height;
+    if (resolution[0] > PRINTER_DPI)
+        *out_width = (unsigned)(((uint64_t)width * PRINTER_DPI + resolution[0] / 2) / resolution[0]);
+    if (resolution[1] > PRINTER_DPI)
+        *out_height = (unsigned)(((uint64_t)height * PRINTER_DPI + resolution[1] / 2) / resolution[1]);
+    if (*out_width == 0)
+        *out_width = 1;
+    if (*out_height == 0)
+        *out_height = 1;
+    return *out_width != width || *out_height != height;
+}
+
+// Printed size of a raster page, see downscale_size. 1-bit pages were
+// already thresholded for the printer and are never scaled.
+int raster_scaled_size(const cups_page_header2_t *header, unsigned *width, unsigned *height)
+{
+    if (raster_is_bilevel(header))
+    {
+        *width = header->cupsWidth;
+        *height = header->cupsHeight;
+        return 0;
+    }
+    return downscale_size(header->cupsWidth, header->cupsHeight, header->HWResolution, width, height);
+}
+
+// Fixed-point share of pixel 'length' covered by [0, 'position'). Taking
+// differences of these keeps the weights of a pixel adding up exactly.
+static inline int downscale_weight(long long position, long long length)
+{
+    return (int)((position * DOWNSCALE_ONE + length / 2) / length);
+}
+
+// Work out the column taps of a page and clear the line sums. Lengths are
+// counted in units where an input pixel is 'out' long and an output pixel
+// 'in' long, so every overlap is a whole number.
+int downscale_init(downscale_t *scale, int in_width, int in_height, int out_width, int out_height)
+{
+    memset(scale, 0, sizeof(*scale));
+    scale->in_width = in_width;
+    scale->in_height = in_height;
+    scale->out_width = out_width;
+    scale->out_height = out_height;
+
+    // An output column overlaps at most in/out + 2 input columns, and all of
+    // them together no more than in + out
+    size_t taps = (size_t)in_width + out_width;
+    scale->tap_start = malloc(((size_t)out_width + 1) * sizeof(int));
+    scale->tap_input = malloc(taps * sizeof(int));
+    scale->tap_weight = malloc(taps * sizeof(int));
+    scale->line = malloc((size_t)out_width * sizeof(uint32_t));
+    scale->sum = calloc(out_width, sizeof(uint32_t));
+    if (!scale->tap_start || !scale->tap_input || !scale->tap_weight || !scale->line || !scale->sum)
+    {
+        downscale_free(scale);
+        return -1;
+    }
+
+    int tap = 0;
+    for (int x = 0; x < out_width; ++x)
+    {
+        long long start = (long long)x * in_width;
+        long long end = start + in_width;
+        int covered = 0;
+        scale->tap_start[x] = tap;
+        for (long long i = start / out_width; i * out_width < end; ++i)
+        {
+            long long overlap_end = (i + 1) * out_width < end ? (i + 1) * out_width : end;
+            int weight = downscale_weight(overlap_end - start, in_width);
+            if (weight > covered)
+            {
+                scale->tap_input[tap] = (int)i;
+                scale->tap_weight[tap] = weight - covered;
+                tap++;
+            }
+            covered = weight;
+        }
+    }
+    scale->tap_start[out_width] = tap;
+    return 0;
+}
+
+// Feed the next 'rows' gray lines, 'in_width' apart, and write the output
+// lines they complete to 'out_data', 'out_width' apart. Returns the number of
+// lines written. An output line never lands past the input not yet read, so
+// 'out_data' may be 'gray_data' and bands are scaled in place.
+int downscale_rows(downscale_t *scale, const unsigned char *gray_data, unsigned char *out_data, int rows)
+{
+    int in_width = scale->in_width;
+    int out_width = scale->out_width;
+    long long in_height = scale->in_height;
+    long long out_height = scale->out_height;
+    uint32_t *line = scale->line;
+    uint32_t *sum = scale->sum;
+    int written = 0;
+
+    for (int r = 0; r < rows && scale->out_y < scale->out_height; ++r)
+    {
+        const unsigned char *in = gray_data + (size_t)r * in_width;
+        for (int x = 0; x < out_width; ++x)
+        {
+            uint32_t total = 0;
+            for (int t = scale->tap_start[x]; t < scale->tap_start[x + 1]; ++t)
+            {
+                total += (uint32_t)scale->tap_weight[t] * in[scale->tap_input[t]];
+            }
+            line[x] = total;
+        }
+
+        // Share the line between the output lines it overlaps, at most two
+        long long position = scale->in_y * out_height;
+        long long end = position + out_height;
+        while (position < end && scale->out_y < scale->out_height)
+        {
+            long long line_start = scale->out_y * in_height;
+            long long line_end = line_start + in_height;
+            long long part_end = end < line_end ? end : line_end;
+            uint32_t weight =
+                (uint32_t)(downscale_weight(part_end - line_start, in_height) - downscale_weight(position - line_start, in_height));
+            for (int x = 0; x < out_width; ++x)
+            {
+                sum[x] += line[x] * weight;
+            }
+            position = part_end;
+
+            if (part_end == line_end)
+            {
+                unsigned char *out = out_data + (size_t)written * out_width;
+                for (int x = 0; x < out_width; ++x)
+                {
+                    out[x] = (unsigned char)((sum[x] + (DOWNSCALE_ONE * DOWNSCALE_ONE / 2)) / (DOWNSCALE_ONE * DOWNSCALE_ONE));
+                    sum[x] = 0;
+                }
+                written++;
+                scale->out_y++;
+            }
+        }
+        scale->in_y++;
+    }
+    return written;
+}
+
+void downscale_free(downscale_t *scale)
+{
+    free(scale->tap_start);
+    free(scale->tap_input);
+    free(scale->tap_weight);
+    free(scale->line);
+    free(scale->sum);
+    memset(scale, 0, sizeof(*scale));
+}
+
+// Downscale a whole gray page in place
+int downscale_page(unsigned char *gray_data, int in_width, int in_height, int out_width, int out_height)
+{
+    downscale_t scale;
+    if (downscale_init(&scale, in_width, in_height, out_width, out_height) < 0)
+        return -1;
+    downscale_rows(&scale, gray_data, gray_data, in_height);
+    downscale_free(&scale);
+    return 0;
+}
+
+// Copy 1-bit raster lines into packed lines. CUPS_CSPACE_W sets the bits of
+// white pixels like the printer does, CUPS_CSPACE_K sets black ones and is
+// copied with 'invert'. The pad bits of each line are forced white.
+void copy_bilevel_rows(const unsigned char *raster_data, int bytes_per_line, unsigned char *mono_data, int width, int rows,
+                       int invert)
+{
+    int width_bytes = (width + 7) / 8;
+    unsigned char flip = invert ? 0xFF : 0x00;
+    unsigned char pad = (unsigned char)(0xFF >> (width - (width_bytes - 1) * 8));
+
+    for (int y = 0; y < rows; ++y)
+    {
+        const unsigned char *src = raster_data + (size_t)y * bytes_per_line;
+        unsigned char *dst = mono_data + (size_t)y * width_bytes;
+        if (flip)
+        {
+            for (int i = 0; i < width_bytes; ++i)
+            {
+                dst[i] = src[i] ^ flip;
+            }
+        }
+        else
+        {
+            memcpy(dst, src, width_bytes);
+        }
+        dst[width_bytes - 1] |= pad;
+    }
+}
+
+// Convert 8-bit grayscale to 1-bit monochrome with the selected algorithm
+int convert_gray_to_mono(unsigned char *gray_data, unsigned char *mono_data, int width, int height, int print_mode, int threads)
+{
+    dither_state_t state;
+    if (dither_init(&state, width, print_mode, threads) < 0)
+        return -1;
+
+    dither_rows(&state, gray_data, mono_data, height);
+
+    dither_free(&state);
+    return 0;
+}
+
+// Allocate the lines and zeroed error rows for a page 'width' pixels wide
+int dither_init(dither_state_t *state, int width, int print_mode, int threads)
+{
+    const unsigned char *tile = NULL;
+    int tile_size = 1;
+    if (print_mode == PRINT_MODE_BAYER)
+    {
+        tile = bayer_tile;
+        tile_size = 8;
+    }
+    else if (print_mode == PRINT_MODE_BLUE_NOISE)
+    {
+        tile = blue_noise_tile;
+        tile_size = 32;
+    }
+
+    state->width = width;
+    state->print_mode = print_mode;
+    state->threads = threads;
+    state->threshold_rows = tile_size;
+    state->row = 0;
+    state->tone_identity = 1;
+    for (int i = 0; i < 256; ++i)
+    {
+        state->tone[i] = (unsigned char)i;
+    }
+    state->threshold = malloc(tile_size * width);
+    state->line = malloc(width);
+    state->current = calloc(width + 2, sizeof(int));
+    state->next = calloc(width + 2, sizeof(int));
+    state->error_rows = NULL;
+    if (print_mode >= PRINT_MODE_SERPENTINE && print_mode <= PRINT_MODE_SIERRA_LITE)
+        state->error_rows = calloc(KERNEL_ROWS * (width + 2 * KERNEL_PAD), sizeof(int));
+    if (!state->threshold || !state->line || !state->current || !state->next ||
+        (print_mode >= PRINT_MODE_SERPENTINE && print_mode <= PRINT_MODE_SIERRA_LITE && !state->error_rows))
+    {
+        dither_free(state);
+        return -1;
+    }
+
+    if (!tile)
+    {
+        memset(state->threshold, 128, width);
+        return 0;
+    }
+
+    // Repeat the tile across the width once, so every line of the page only
+    // needs a pointer into these rows
+    for (int y = 0; y < tile_size; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            state->threshold[y * width + x] = tile[y * tile_size + x % tile_size];
+        }
+    }
+    return 0;
+}
+
+// Start a new page with the same width and algorithm
+void dither_restart(dither_state_t *state)
+{
+    memset(state->current, 0, (state->width + 2) * sizeof(int));
+    memset(state->next, 0, (state->width + 2) * sizeof(int));
+    if (state->error_rows)
+        memset(state->error_rows, 0, KERNEL_ROWS * (state->width + 2 * KERNEL_PAD) * sizeof(int));
+    state->row = 0;
+}
+
+// Use the job's tone curve, see build_tone_curve()
+void dither_set_tone(dither_state_t *state, const print_job_config_t *config)
+{
+    state->tone_identity = config->tone_identity;
+    memcpy(state->tone, config->tone, sizeof(state->tone));
+}
+
+void dither_free(dither_state_t *state)
+{
+    free(state->threshold);
+    free(state->line);
+    free(state->current);
+    free(state->next);
+    free(state->error_rows);
+    state->threshold = NULL;
+    state->line = NULL;
+    state->current = NULL;
+    state->next = NULL;
+    state->error_rows = NULL;
+}
+
+// Pixels remapped through the tone table per pack call. A multiple of 8, so
+// every chunk but the last fills whole bytes.
+#define TONE_CHUNK 512
+
+// Threshold 'rows' lines against the state's threshold lines, starting at
+// page line 'first_row'
+static void dither_ordered_rows(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int first_row, int rows)
+{
+    int width = state->width;
+    int width_bytes = (width + 7) / 8;
+
+    for (int y = 0; y < rows; y++)
+    {
+        const unsigned char *gray = gray_data + y * width;
+        const unsigned char *threshold = state->threshold + ((first_row + y) % state->threshold_rows) * width;
+        unsigned char *mono = mono_data + y * width_bytes;
+        if (state->tone_identity)
+        {
+            pack_threshold_line(gray, threshold, mono, width);
+            continue;
+        }
+
+        // Remap a chunk at a time into a buffer that stays in L1, local so
+        // parallel runs do not share it
+        unsigned char toned[TONE_CHUNK];
+        for (int x0 = 0; x0 < width; x0 += TONE_CHUNK)
+        {
+            int count = width - x0 < TONE_CHUNK ? width - x0 : TONE_CHUNK;
+            for (int i = 0; i < count; ++i)
+            {
+                toned[i] = state->tone[gray[x0 + i]];
+            }
+            pack_threshold_line(toned, threshold + x0, mono + x0 / 8, count);
+        }
+    }
+}
+
+// Below this many lines per thread, starting threads costs more than it saves
+#define DITHER_MIN_THREAD_ROWS 16
+
+// Dither 'rows' gray lines into packed 1-bit lines. Consecutive calls continue
+// the same page.
+void dither_rows(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows)
+{
+    int parallel = state->threads > 1 && rows >= 2 * DITHER_MIN_THREAD_ROWS;
+
+    switch (state->print_mode)
+    {
+    case PRINT_MODE_NONE:
+    case PRINT_MODE_BAYER:
+    case PRINT_MODE_BLUE_NOISE:
+        // No dependency between pixels, every line is a single kernel call
+        if (!parallel || dither_ordered_parallel(state, gray_data, mono_data, rows) < 0)
+            dither_ordered_rows(state, gray_data, mono_data, state->row, rows);
+        break;
+
+    case PRINT_MODE_SERPENTINE:
+    case PRINT_MODE_ATKINSON:
+    case PRINT_MODE_STUCKI:
+    case PRINT_MODE_SIERRA_LITE:
+        // Each line runs against the one before it, so these stay serial
+        kernel_diffusion(state, gray_data, mono_data, rows);
+        break;
+
+    default:
+        // We'll use Floyd-Steinberg error diffusion as it's a common and effective algorithm.
+        if (!parallel || error_diffusion_wavefront(state, gray_data, mono_data, rows) < 0)
+            error_diffusion(state, gray_data, mono_data, rows);
+        break;
+    }
+
+    state->row += rows;
+}
+
+// Floyd-Steinberg over pixels [x0, x1) of one line. 'current' and 'next'
+// point at the first real entry of padded error rows.
+static inline void diffuse_span(const unsigned char *gray_row, const unsigned char *tone, int *current, int *next, unsigned char *line, int x0, int x1)
+{
+    for (int x = x0; x < x1; x++)
+    {
+        int old_pixel = tone[gray_row[x]] + current[x];
+        int new_pixel = (old_pixel < 128) ? 0 : 255;
+        line[x] = (unsigned char)new_pixel;
+
+        int quant_error = old_pixel - new_pixel;
+
+        current[x + 1] += quant_error * 7 / 16;
+        next[x - 1] += quant_error * 3 / 16;
+        next[x] += quant_error * 5 / 16;
+        next[x + 1] += quant_error * 1 / 16;
+    }
+}
+
+// Floyd-Steinberg error diffusion of 'rows' gray lines. Each line is quantized
+// to 0/255 and handed to the pack kernel, error for lines below is kept in
+// the state.
+void error_diffusion(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows)
+{
+    int width = state->width;
+    int width_bytes = (width + 7) / 8;
+
+    for (int y = 0; y < rows; y++)
+    {
+        diffuse_span(gray_data + y * width, state->tone, state->current + 1, state->next + 1, state->line, 0, width);
+        pack_threshold_line(state->line, state->threshold, mono_data + y * width_bytes, width);
+
+        // The next line becomes current, and the old current line is recycled
+        int *done = state->current;
+        state->current = state->next;
+        state->next = done;
+        memset(state->next, 0, (width + 2) * sizeof(int));
+    }
+}
+
+// Quantize one pixel to 0/255 without a branch, returning the error to spread
+static inline int quantize_pixel(int value, unsigned char *out)
+{
+    int new_pixel = -(value >= 128) & 255;
+    *out = (unsigned char)new_pixel;
+    return value - new_pixel;
+}
+
+// Diffuse one line with the state's kernel, walking from 'x' in steps of
+// 'dir'. 'row0' to 'row2' point at the first real entry of the padded error
+// lines for this line and the two below it. Weights are applied with shifts,
+// or for Stucki's 42nds a 16-bit reciprocal, and whatever rounding leaves
+// over goes to one neighbour so no error is lost.
+static void diffuse_kernel_line(int print_mode, const unsigned char *gray_row, const unsigned char *tone, int *row0, int *row1,
+                                int *row2, unsigned char *line, int width, int x, int dir)
+{
+    int d2 = 2 * dir;
+
+    switch (print_mode)
+    {
+    case PRINT_MODE_ATKINSON:
+        // 1/8 to six neighbours, the last quarter of the error is dropped
+        // on purpose, which keeps edges and bars sharp
+        for (int i = 0; i < width; ++i, x += dir)
+        {
+            int e = quantize_pixel(tone[gray_row[x]] + row0[x], line + x) >> 3;
+            row0[x + dir] += e;
+            row0[x + d2] += e;
+            row1[x - dir] += e;
+            row1[x] += e;
+            row1[x + dir] += e;
+            row2[x] += e;
+        }
+        break;
+
+    case PRINT_MODE_STUCKI:
+        // 8 4 / 2 4 8 4 2 / 1 2 4 2 1, in 42nds
+        for (int i = 0; i < width; ++i, x += dir)
+        {
+            int e = quantize_pixel(tone[gray_row[x]] + row0[x], line + x);
+            int u = (e * 1560 + 32768) >> 16;
+            int u2 = u * 2;
+            int u4 = u * 4;
+            row0[x + dir] += e - 34 * u; // 8/42 plus the rounding remainder
+            row0[x + d2] += u4;
+            row1[x - d2] += u2;
+            row1[x - dir] += u4;
+            row1[x] += u4 * 2;
+            row1[x + dir] += u4;
+            row1[x + d2] += u2;
+            row2[x - d2] += u;
+            row2[x - dir] += u2;
+            row2[x] += u4;
+            row2[x + dir] += u2;
+            row2[x + d2] += u;
+        }
+        break;
+
+    case PRINT_MODE_SIERRA_LITE:
+        // 2 to the right, 1 below left and 1 below, in quarters
+        for (int i = 0; i < width; ++i, x += dir)
+        {
+            int e = quantize_pixel(tone[gray_row[x]] + row0[x], line + x);
+            int q = (e + 2) >> 2;
+            row0[x + dir] += e - 2 * q;
+            row1[x - dir] += q;
+            row1[x] += q;
+        }
+        break;
+
+    default:
+        // Floyd-Steinberg, 7 3 5 1 in 16ths
+        for (int i = 0; i < width; ++i, x += dir)
+        {
+            int e = quantize_pixel(tone[gray_row[x]] + row0[x], line + x);
+            int e7 = (e * 7 + 8) >> 4;
+            int e3 = (e * 3 + 8) >> 4;
+            int e5 = (e * 5 + 8) >> 4;
+            row0[x + dir] += e7;
+            row1[x - dir] += e3;
+            row1[x] += e5;
+            row1[x + dir] += e - e7 - e3 - e5;
+        }
+        break;
+    }
+}
+
+// Serpentine error diffusion of 'rows' gray lines: even page lines run left
+// to right and odd ones right to left, which breaks up the diagonal worms
+// one-way scanning leaves in flat areas.
+void kernel_diffusion(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows)
+{
+    int width = state->width;
+    int width_bytes = (width + 7) / 8;
+    int stride = width + 2 * KERNEL_PAD;
+
+    for (int y = 0; y < rows; y++)
+    {
+        int page_row = state->row + y;
+        int *row0 = state->error_rows + (page_row % KERNEL_ROWS) * stride + KERNEL_PAD;
+        int *row1 = state->error_rows + ((page_row + 1) % KERNEL_ROWS) * stride + KERNEL_PAD;
+        int *row2 = state->error_rows + ((page_row + 2) % KERNEL_ROWS) * stride + KERNEL_PAD;
+        int reverse = page_row & 1;
+
+        diffuse_kernel_line(state->print_mode, gray_data + y * width, state->tone, row0, row1, row2, state->line, width,
+                            reverse ? width - 1 : 0, reverse ? -1 : 1);
+        pack_threshold_line(state->line, state->threshold, mono_data + y * width_bytes, width);
+
+        // This line's errors are spent, it comes back as the line two below
+        memset(row0 - KERNEL_PAD, 0, stride * sizeof(int));
+    }
+}
+
+// Pixels a wavefront worker diffuses between progress updates
+#define WAVEFRONT_CHUNK 64
+
+// Shared between the threads of one wavefront run
+typedef struct wavefront_s
+{
+    dither_state_t *state;
+    const unsigned char *gray_data;
+    unsigned char *mono_data;
+    int rows;
+    int ring_rows;         // Error lines in the ring, at least threads + 1
+    int *errors;           // ring_rows padded error lines
+    atomic_long *progress; // Per ring slot: line * (width + 1) + finished pixels
+    atomic_int next_row;   // Next line to hand to a worker
+} wavefront_t;
+
+static void *wavefront_worker(void *arg)
+{
+    wavefront_t *wave = arg;
+    int width = wave->state->width;
+    int width_bytes = (width + 7) / 8;
+    long line_span = width + 1;
+    // A worker that cannot start leaves its share of lines to the others
+    unsigned char *line = malloc(width);
+    if (!line)
+        return NULL;
+
+    for (;;)
+    {
+        // Lines are claimed in order, so every line this thread waits on is
+        // already owned by a running worker and the wait always ends
+        int y = atomic_fetch_add(&wave->next_row, 1);
+        if (y >= wave->rows)
+            break;
+
+        int *current = wave->errors + (y % wave->ring_rows) * (width + 2) + 1;
+        int *next = wave->errors + ((y + 1) % wave->ring_rows) * (width + 2) + 1;
+        const unsigned char *gray_row = wave->gray_data + (size_t)y * width;
+        atomic_long *above = wave->progress + (y + wave->ring_rows - 1) % wave->ring_rows;
+        atomic_long *mine = wave->progress + y % wave->ring_rows;
+
+        // The slot for the next line was last read by a line that has finished
+        memset(next - 1, 0, (width + 2) * sizeof(int));
+
+        for (int x0 = 0; x0 < width; x0 += WAVEFRONT_CHUNK)
+        {
+            int x1 = x0 + WAVEFRONT_CHUNK < width ? x0 + WAVEFRONT_CHUNK : width;
+
+            // Pixel x reads current[x] and adds into current[x + 1], so the
+            // line above must have finished pixel x + 2 and moved past it
+            if (y > 0)
+            {
+                long need = (long)(y - 1) * line_span + (x1 + 2 < width ? x1 + 2 : width);
+                while (atomic_load_explicit(above, memory_order_acquire) < need)
+                    sched_yield();
+            }
+
+            diffuse_span(gray_row, wave->state->tone, current, next, line, x0, x1);
+            atomic_store_explicit(mine, (long)y * line_span + x1, memory_order_release);
+        }
+
+        pack_threshold_line(line, wave->state->threshold, wave->mono_data + (size_t)y * width_bytes, width);
+    }
+
+    free(line);
+    return NULL;
+}
+
+// Floyd-Steinberg split across threads as a wavefront: each worker takes a
+// whole line and trails the line above it by a few pixels, so the result is
+// identical to the serial loop. Returns -1 without touching the state if the
+// threads could not be set up.
+int error_diffusion_wavefront(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows)
+{
+    int width = state->width;
+    int threads = state->threads;
+    wavefront_t wave;
+    wave.state = state;
+    wave.gray_data = gray_data;
+    wave.mono_data = mono_data;
+    wave.rows = rows;
+    wave.ring_rows = threads + 2;
+    wave.errors = malloc(wave.ring_rows * (width + 2) * sizeof(int));
+    wave.progress = malloc(wave.ring_rows * sizeof(atomic_long));
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (!wave.errors || !wave.progress || !workers)
+    {
+        free(wave.errors);
+        free(wave.progress);
+        free(workers);
+        return -1;
+    }
+
+    for (int i = 0; i < wave.ring_rows; ++i)
+    {
+        atomic_init(wave.progress + i, -1);
+    }
+    atomic_init(&wave.next_row, 0);
+
+    // Error carried from the previous call seeds the first line
+    memcpy(wave.errors, state->current, (width + 2) * sizeof(int));
+
+    int started = 0;
+    for (; started < threads; ++started)
+    {
+        if (pthread_create(workers + started, NULL, wavefront_worker, &wave) != 0)
+            break;
+    }
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    // A claimed line is always finished, so either every line was done or
+    // no worker got going and the serial loop takes over
+    int status = -1;
+    if (atomic_load(&wave.next_row) > 0)
+    {
+        memcpy(state->current, wave.errors + (rows % wave.ring_rows) * (width + 2), (width + 2) * sizeof(int));
+        memset(state->next, 0, (width + 2) * sizeof(int));
+        status = 0;
+    }
+
+    free(wave.errors);
+    free(wave.progress);
+    free(workers);
+    return status;
+}
+
+// Shared between the threads of one parallel ordered dither
+typedef struct ordered_job_s
+{
+    dither_state_t *state;
+    const unsigned char *gray_data;
+    unsigned char *mono_data;
+    int first_row; // Page line of the first line in this band
+    int rows;      // Lines for this thread
+} ordered_job_t;
+
+static void *ordered_worker(void *arg)
+{
+    ordered_job_t *job = arg;
+    dither_ordered_rows(job->state, job->gray_data, job->mono_data, job->first_row, job->rows);
+    return NULL;
+}
+
+// Split thresholding across threads in contiguous runs of lines, the calling
+// thread doing the last run. Returns -1 if no thread could be started.
+int dither_ordered_parallel(dither_state_t *state, const unsigned char *gray_data, unsigned char *mono_data, int rows)
+{
+    int width = state->width;
+    int width_bytes = (width + 7) / 8;
+    int threads = state->threads;
+    if (threads > rows / DITHER_MIN_THREAD_ROWS)
+        threads = rows / DITHER_MIN_THREAD_ROWS;
+
+    ordered_job_t *jobs = malloc(threads * sizeof(ordered_job_t));
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (!jobs || !workers)
+    {
+        free(jobs);
+        free(workers);
+        return -1;
+    }
+
+    int started = 0;
+    int y = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        int count = (rows - y) / (threads - i);
+        jobs[i].state = state;
+        jobs[i].gray_data = gray_data + (size_t)y * width;
+        jobs[i].mono_data = mono_data + (size_t)y * width_bytes;
+        jobs[i].first_row = state->row + y;
+        jobs[i].rows = count;
+        y += count;
+
+        if (i == threads - 1)
+            break;
+        if (pthread_create(workers + i, NULL, ordered_worker, jobs + i) != 0)
+            break;
+        started++;
+    }
+
+    // Whatever did not get a thread is done here
+    int first = started ? jobs[started].first_row - state->row : 0;
+    dither_ordered_rows(state, gray_data + (size_t)first * width, mono_data + (size_t)first * width_bytes,
+                        state->row + first, rows - first);
+
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(jobs);
+    free(workers);
+    return 0;
+}
+
+// Reverses the bit order of a byte, for kernels whose masks come out LSB first
+unsigned char bit_reverse[256];
+
+// Selected by pack_init() from the features of the running CPU
+pack_threshold_fn pack_threshold_line = pack_threshold_scalar;
+
+// Pack the pixels from 'x' to the end of the line one at a time
+static void pack_threshold_tail(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int x, int width)
+{
+    // *** MODIFICATION FOR INVERTED PRINTING ***
+    // Set bits are white on the printer, black pixels clear them
+    for (; x + 8 <= width; x += 8)
+    {
+        unsigned bits = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            bits = (bits << 1) | (gray[x + i] >= threshold[x + i]);
+        }
+        mono[x >> 3] = (unsigned char)bits;
+    }
+
+    if (x < width)
+    {
+        unsigned bits = 0xFF;
+        for (int i = 0; x + i < width; ++i)
+        {
+            if (gray[x + i] < threshold[x + i])
+                bits &= ~(0x80u >> i);
+        }
+        mono[x >> 3] = (unsigned char)bits;
+    }
+}
+
+void pack_threshold_scalar(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int width)
+{
+    pack_threshold_tail(gray, threshold, mono, 0, width);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static void pack_threshold_sse2(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i g = _mm_loadu_si128((const __m128i *)(gray + x));
+        __m128i t = _mm_loadu_si128((const __m128i *)(threshold + x));
+        // Unsigned g >= t
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(g, t), g));
+        mono[x >> 3] = bit_reverse[mask & 0xFF];
+        mono[(x >> 3) + 1] = bit_reverse[mask >> 8];
+    }
+    pack_threshold_tail(gray, threshold, mono, x, width);
+}
+
+__attribute__((target("avx2"))) static void pack_threshold_avx2(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int width)
+{
+    // Reverse each group of 8 pixels so the first one lands in the top bit
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i g = _mm256_loadu_si256((const __m256i *)(gray + x));
+        __m256i t = _mm256_loadu_si256((const __m256i *)(threshold + x));
+        __m256i white = _mm256_cmpeq_epi8(_mm256_max_epu8(g, t), g);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_shuffle_epi8(white, reverse));
+        memcpy(mono + (x >> 3), &mask, 4);
+    }
+    pack_threshold_tail(gray, threshold, mono, x, width);
+}
+#elif defined(__ARM_NEON)
+static void pack_threshold_neon(const unsigned char *gray, const unsigned char *threshold, unsigned char *mono, int width)
+{
+    static const uint8_t weights[16] = {128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1};
+    const uint8x16_t bit = vld1q_u8(weights);
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t white = vcgeq_u8(vld1q_u8(gray + x), vld1q_u8(threshold + x));
+        uint8x16_t bits = vandq_u8(white, bit);
+        // Three pairwise adds fold each group of 8 weighted lanes into a byte
+        uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+        sum = vpadd_u8(sum, sum);
+        sum = vpadd_u8(sum, sum);
+        vst1_lane_u16((uint16_t *)(mono + (x >> 3)), vreinterpret_u16_u8(sum), 0);
+    }
+    pack_threshold_tail(gray, threshold, mono, x, width);
+}
+#endif
+
+// Build the lookup tables and pick the fastest pack kernel this CPU supports.
+// NEON is part of every AArch64 CPU, so on ARM it is used whenever the filter
+// was compiled for it.
+void pack_init(void)
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        unsigned r = 0;
+        for (int b = 0; b < 8; ++b)
+        {
+            if (i & (1 << b))
+                r |= 0x80u >> b;
+        }
+        bit_reverse[i] = (unsigned char)r;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        pack_threshold_line = pack_threshold_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        pack_threshold_line = pack_threshold_sse2;
+#elif defined(__ARM_NEON)
+    pack_threshold_line = pack_threshold_neon;
+#endif
+}
+
+// Mirror one packed line of 'width' pixels in place. Reversing the bytes and
+// their bits leaves the pad bits at the start of the line, so the line is
+// then shifted left by the pad and its end padded with white again.
+void mirror_mono_row(unsigned char *line, int width)
+{
+    int width_bytes = (width + 7) / 8;
+    int pad = width_bytes * 8 - width;
+
+    for (int i = 0, j = width_bytes - 1; i <= j; ++i, --j)
+    {
+        unsigned char left = line[i];
+        line[i] = bit_reverse[line[j]];
+        line[j] = bit_reverse[left];
+    }
+
+    if (pad == 0)
+        return;
+
+    for (int i = 0; i + 1 < width_bytes; ++i)
+    {
+        line[i] = (unsigned char)((line[i] << pad) | (line[i + 1] >> (8 - pad)));
+    }
+    line[width_bytes - 1] = (unsigned char)((line[width_bytes - 1] << pad) | (0xFF >> (8 - pad)));
+}
+
+// Transpose an 8x8 bit matrix held one row per byte, row 0 in the top byte
+// and column 0 in the top bit of each row
+static inline uint64_t transpose8x8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+// Source bytes per tile column, so the tile's output rows stay in cache
+// while successive input strips fill them in
+#define ROTATE_TILE_BYTES 32
+
+// Rotate a packed page of 'width' x 'height' pixels clockwise by 90 (2),
+// 180 (1) or 270 (3) degrees into 'dst', which for 90 and 270 is 'height'
+// pixels wide and 'width' high. The page is walked in 8x8 pixel blocks that
+// are transposed in a register; pixels past the edge of the page are white.
+void rotate_mono(const unsigned char *src, unsigned char *dst, int width, int height, int rotate)
+{
+    int width_bytes = (width + 7) / 8;
+
+    if (rotate == 1)
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            memcpy(dst + (size_t)y * width_bytes, src + (size_t)(height - 1 - y) * width_bytes, width_bytes);
+            mirror_mono_row(dst + (size_t)y * width_bytes, width);
+        }
+        return;
+    }
+
+    // Each output byte column is one strip of 8 source rows
+    int out_width_bytes = (height + 7) / 8;
+
+    for (int tile = 0; tile < width_bytes; tile += ROTATE_TILE_BYTES)
+    {
+        int tile_end = tile + ROTATE_TILE_BYTES < width_bytes ? tile + ROTATE_TILE_BYTES : width_bytes;
+
+        for (int strip = 0; strip < out_width_bytes; ++strip)
+        {
+            // Output pixel columns 8*strip .. 8*strip+7 come from these rows,
+            // in order; rows outside the page read as white
+            const unsigned char *rows[8];
+            for (int j = 0; j < 8; ++j)
+            {
+                int y = rotate == 2 ? height - 1 - (strip * 8 + j) : strip * 8 + j;
+                rows[j] = y >= 0 && y < height ? src + (size_t)y * width_bytes : NULL;
+            }
+
+            for (int bx = tile; bx < tile_end; ++bx)
+            {
+                uint64_t block = 0;
+                for (int j = 0; j < 8; ++j)
+                {
+                    block = (block << 8) | (rows[j] ? rows[j][bx] : 0xFF);
+                }
+                block = transpose8x8(block);
+
+                // Byte k of the result is source column 8*bx+k; columns in
+                // the pad of the source line have no output row
+                for (int k = 0; k < 8; ++k)
+                {
+                    int x = bx * 8 + k;
+                    if (x >= width)
+                        break;
+                    int out_y = rotate == 2 ? x : width - 1 - x;
+                    dst[(size_t)out_y * out_width_bytes + strip] = (unsigned char)(block >> (56 - 8 * k));
+                }
+            }
+        }
+    }
+}
+
+// Set up 'input' for reading 'fd', mapping it when it is a regular file
+int raster_input_open(raster_input_t *input, int fd)
+{
+    memset(input, 0, sizeof(*input));
+    input->fd = fd;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && (uint64_t)info.st_size <= SIZE_MAX)
+    {
+        void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+            input->map = map;
+            input->map_length = (size_t)info.st_size;
+            input->available = input->map_length;
+            fprintf(stderr, "DEBUG: Reading %zu bytes of raster input from a mapped file.\n", input->map_length);
+            return 0;
+        }
+    }
+
+    // Page aligned, so large reads from the pipe land on whole pages
+    if (posix_memalign((void **)&input->block, 4096, INPUT_BLOCK_SIZE) != 0)
+    {
+        input->block = NULL;
+        fprintf(stderr, "ERROR: Unable to allocate the raster input buffer.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// cupsRasterOpenIO() callback. Returns the bytes copied to 'buffer', 0 at
+// the end of the input and -1 on a read error.
+ssize_t raster_input_read(void *ctx, unsigned char *buffer, size_t length)
+{
+    raster_input_t *input = ctx;
+
+    if (input->position == input->available)
+    {
+        if (input->map)
+            return 0;
+        if (input->timed_out)
+            return -1;
+
+        // Requests as large as the block skip it and go straight to the caller
+        unsigned char *target = length >= INPUT_BLOCK_SIZE ? buffer : input->block;
+        size_t size = length >= INPUT_BLOCK_SIZE ? length : INPUT_BLOCK_SIZE;
+        ssize_t got;
+        do
+        {
+            got = read(input->fd, target, size);
+            input->reads++;
+        } while (got < 0 && errno == EINTR);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            fprintf(stderr, "ERROR: Timed out waiting for raster input.\n");
+            input->timed_out = 1;
+        }
+        if (got <= 0)
+            return got;
+        if (target == buffer)
+            return got;
+
+        input->position = 0;
+        input->available = (size_t)got;
+    }
+
+    const unsigned char *data = input->map ? input->map : input->block;
+    size_t count = input->available - input->position;
+    if (count > length)
+        count = length;
+    memcpy(buffer, data + input->position, count);
+    input->position += count;
+    return (ssize_t)count;
+}
+
+// Copy up to 'length' upcoming bytes without consuming them, so the format
+// of the input can be checked before libcups reads it. Returns the bytes
+// copied, fewer only at the end of the input.
+size_t raster_input_peek(raster_input_t *input, unsigned char *buffer, size_t length)
+{
+    if (!input->map && input->available - input->position < length)
+    {
+        // Keep what is left at the start of the block and top it up
+        size_t left = input->available - input->position;
+        memmove(input->block, input->block + input->position, left);
+        input->position = 0;
+        input->available = left;
+        while (input->available < length)
+        {
+            ssize_t got = read(input->fd, input->block + input->available, INPUT_BLOCK_SIZE - input->available);
+            input->reads++;
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            input->available += got;
+        }
+    }
+
+    const unsigned char *data = input->map ? input->map : input->block;
+    size_t count = input->available - input->position;
+    if (count > length)
+        count = length;
+    memcpy(buffer, data + input->position, count);
+    return count;
+}
+
+void raster_input_close(raster_input_t *input)
+{
+    if (input->map)
+        munmap((void *)input->map, input->map_length);
+    if (input->block)
+        fprintf(stderr, "DEBUG: Read raster input with %ld read calls.\n", input->reads);
+    free(input->block);
+    input->map = NULL;
+    input->block = NULL;
+}
+
+// Bytes of command text queued at once, and iovecs per writev
+#define OUTPUT_TEXT_SIZE 4096
+#define OUTPUT_IOVECS 64
+
+// Smallest staging buffer for copied bitmap rectangles
+#define OUTPUT_STAGE_SIZE (256 * 1024)
+
+// Printer output waiting for output_flush(). Command text is copied into
+// 'text', bitmap data is only pointed at, or copied into 'stage' when it is
+// a rectangle narrower than the page. Used by one thread at a time, the
+// pipeline writer when there is one.
+typedef struct output_queue_s
+{
+    struct iovec iov[OUTPUT_IOVECS];
+    int count;
+    char text[OUTPUT_TEXT_SIZE];
+    size_t text_used;
+    unsigned char *stage; // Only grows, and is kept from job to job
+    size_t stage_size;
+    size_t stage_used;
+    int fd;     // Descriptor output_flush() writes to
+    int failed; // A write failed, later output is dropped
+} output_queue_t;
+
+static output_queue_t output_queue = {.fd = STDOUT_FILENO};
+
+static void output_push(const void *data, size_t length)
+{
+    if (length == 0)
+        return;
+
+    // Extend the last entry when the new bytes follow straight on
+    if (output_queue.count > 0)
+    {
+        struct iovec *last = output_queue.iov + output_queue.count - 1;
+        if ((const char *)last->iov_base + last->iov_len == (const char *)data)
+        {
+            last->iov_len += length;
+            return;
+        }
+    }
+
+    if (output_queue.count == OUTPUT_IOVECS)
+        output_flush();
+    output_queue.iov[output_queue.count].iov_base = (void *)data;
+    output_queue.iov[output_queue.count].iov_len = length;
+    output_queue.count++;
+}
+
+// Queue a copy of 'text'
+void output_text(const char *text, size_t length)
+{
+    while (length > 0)
+    {
+        // Flush before copying, so the copy is not queued after a reset
+        if (output_queue.text_used == OUTPUT_TEXT_SIZE || output_queue.count == OUTPUT_IOVECS)
+            output_flush();
+
+        size_t chunk = OUTPUT_TEXT_SIZE - output_queue.text_used;
+        if (chunk > length)
+            chunk = length;
+        char *copy = output_queue.text + output_queue.text_used;
+        memcpy(copy, text, chunk);
+        output_queue.text_used += chunk;
+        output_push(copy, chunk);
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+// Queue a formatted command
+void output_printf(const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length < 0)
+        return;
+    if ((size_t)length >= sizeof(line))
+        length = sizeof(line) - 1;
+    output_text(line, length);
+}
+
+// Queue 'data' without copying it. It has to stay valid and unchanged until
+// the next output_flush().
+void output_data(const void *data, size_t length)
+{
+    output_push(data, length);
+}
+
+// Queue a copy of 'rows' lines of 'length' bytes, 'stride' apart, as one
+// block. Pointing at each line instead would take an iovec per line and a
+// writev every few dozen lines.
+void output_rows(const unsigned char *data, size_t length, int rows, size_t stride)
+{
+    size_t size = length * rows;
+    if (output_queue.stage_size - output_queue.stage_used < size || output_queue.count == OUTPUT_IOVECS)
+    {
+        // Flush before copying, nothing queued may point into a buffer
+        // that is about to be reused or replaced
+        output_flush();
+        if (output_queue.stage_size < size)
+        {
+            size_t grown = size > OUTPUT_STAGE_SIZE ? size : OUTPUT_STAGE_SIZE;
+            free(output_queue.stage);
+            output_queue.stage = malloc(grown);
+            output_queue.stage_size = output_queue.stage ? grown : 0;
+        }
+    }
+
+    if (output_queue.stage_size < size)
+    {
+        for (int y = 0; y < rows; ++y)
+        {
+            output_data(data + y * stride, length);
+        }
+        return;
+    }
+
+    unsigned char *copy = output_queue.stage + output_queue.stage_used;
+    for (int y = 0; y < rows; ++y)
+    {
+        memcpy(copy + y * length, data + y * stride, length);
+    }
+    output_queue.stage_used += size;
+    output_push(copy, size);
+}
+
+// Send later output to 'fd' instead of stdout, and forget an earlier write
+// failure. Anything still queued is dropped.
+void output_set_fd(int fd)
+{
+    output_queue.count = 0;
+    output_queue.text_used = 0;
+    output_queue.stage_used = 0;
+    output_queue.fd = fd;
+    output_queue.failed = 0;
+}
+
+// Write everything queued to the output descriptor with writev, resuming after short writes
+// and signals. Returns -1 if the printer output is gone.
+int output_flush(void)
+{
+    struct iovec *iov = output_queue.iov;
+    int count = output_queue.count;
+
+    while (count > 0 && !output_queue.failed)
+    {
+        ssize_t written = writev(output_queue.fd, iov, count);
+        if (written < 0)
+        {
+            // A blocking descriptor only says EAGAIN when its send timeout ran out
+            if (errno == EINTR || (errno == EAGAIN && (fcntl(output_queue.fd, F_GETFL) & O_NONBLOCK)))
+                continue;
+            fprintf(stderr, "ERROR: Unable to write print data: %s\n", strerror(errno));
+            output_queue.failed = 1;
+            break;
+        }
+
+        // Skip what went out, then trim the entry that was cut short
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    output_queue.count = 0;
+    output_queue.text_used = 0;
+    output_queue.stage_used = 0;
+    return output_queue.failed ? -1 : 0;
+}
+
+// Send the final commands and bitmap data to the printer
+void send_printer_commands(unsigned char *mono_data, int width_bytes, int height_pixels, int copies, print_job_config_t *config)
+{
+    if (config->forms && send_form_page(mono_data, width_bytes, height_pixels, copies, config) == 0)
+    {
+        config->retained.height = 0;
+        return;
+    }
+    if (config->differential && send_differential_page(mono_data, width_bytes, height_pixels, copies, config) == 0)
+        return;
+
+    send_page_setup(config);
+    output_stats.page_bytes += (long)width_bytes * height_pixels;
+    if (config->sparse_bitmap)
+        send_sparse_bitmap(mono_data, width_bytes, height_pixels, 0, 0);
+    else
+    {
+        output_printf("BITMAP 0,0,%d,%d,1,", width_bytes, height_pixels);
+        output_data(mono_data, (size_t)width_bytes * height_pixels);
+        output_stats.bitmap_bytes += (long)width_bytes * height_pixels;
+    }
+
+    if (config->differential)
+        retain_page(&config->retained, mono_data, width_bytes, height_pixels);
+    send_page_trailer(copies);
+}
+
+// Find the first and last bytes of a packed line that hold a black pixel,
+// returns 0 for a blank line
+static int find_inked_span(const unsigned char *line, int width_bytes, int *left, int *right)
+{
+    int l = 0;
+    while (l < width_bytes && line[l] == 0xFF)
+        ++l;
+    if (l == width_bytes)
+        return 0;
+
+    int r = width_bytes - 1;
+    while (line[r] == 0xFF)
+        --r;
+
+    *left = l;
+    *right = r;
+    return 1;
+}
+
+// Emit one rectangle of packed lines as a positioned BITMAP command. Mode 1
+// ORs it into the image buffer, mode 0 overwrites what is there.
+static void send_bitmap_rect(const unsigned char *mono_data, int width_bytes, int top, int bottom, int left, int right,
+                             int y_offset, int bitmaps_sent, int mode)
+{
+    // Bitmap data is binary, so a command that follows one starts a new line
+    output_printf("%sBITMAP %d,%d,%d,%d,%d,", bitmaps_sent ? "\r\n" : "", left * 8, y_offset + top, right - left + 1,
+                  bottom - top + 1, mode);
+
+    // Full lines follow on in the page and go out as they are
+    if (left == 0 && right == width_bytes - 1)
+        output_data(mono_data + top * width_bytes, (size_t)width_bytes * (bottom - top + 1));
+    else
+        output_rows(mono_data + top * width_bytes + left, right - left + 1, bottom - top + 1, width_bytes);
+    output_stats.bitmap_bytes += (long)(right - left + 1) * (bottom - top + 1);
+}
+
+// Approximate size of a BITMAP command header, used to decide when bridging
+// blank lines is cheaper than starting a new rectangle
+#define SPARSE_BITMAP_OVERHEAD 24
+
+// Emit only the inked parts of 'rows' packed lines as positioned BITMAP
+// commands. Blank lines and blank bytes at either side are skipped. A line is
+// merged into the rectangle above it when widening or bridging costs fewer
+// bytes than another command would. Returns the number of BITMAP commands
+// sent for the page so far.
+int send_sparse_bitmap(const unsigned char *mono_data, int width_bytes, int rows, int y_offset, int bitmaps_sent)
+{
+    int top = -1, bottom = 0, left = 0, right = 0;
+
+    for (int y = 0; y < rows; ++y)
+    {
+        int line_left, line_right;
+        if (!find_inked_span(mono_data + y * width_bytes, width_bytes, &line_left, &line_right))
+            continue;
+
+        if (top >= 0)
+        {
+            int merged_left = line_left < left ? line_left : left;
+            int merged_right = line_right > right ? line_right : right;
+            long merged = (long)(merged_right - merged_left + 1) * (y - top + 1);
+            long separate = (long)(right - left + 1) * (bottom - top + 1) + SPARSE_BITMAP_OVERHEAD + (line_right - line_left + 1);
+            if (merged <= separate)
+            {
+                bottom = y;
+                left = merged_left;
+                right = merged_right;
+                continue;
+            }
+
+            send_bitmap_rect(mono_data, width_bytes, top, bottom, left, right, y_offset, bitmaps_sent++, 1);
+        }
+
+        top = bottom = y;
+        left = line_left;
+        right = line_right;
+    }
+
+    if (top >= 0)
+        send_bitmap_rect(mono_data, width_bytes, top, bottom, left, right, y_offset, bitmaps_sent++, 1);
+
+    return bitmaps_sent;
+}
+
+// Most rectangles a differential update sends before a full page is cheaper
+#define DIFFERENTIAL_MAX_RECTS 64
+
+// A differential update whose bytes exceed a page divided by this is sent
+// as a full page instead
+#define DIFFERENTIAL_MAX_SHARE 2
+
+// True when send_page_setup would send more than CLS for this page
+int page_setup_changed(const print_job_config_t *config)
+{
+    const tspl_state_t *sent = &config->sent;
+    return !sent->valid || sent->page_width_mm != config->page_width_mm || sent->page_height_mm != config->page_height_mm ||
+           sent->gap_height != config->gap_height || sent->gap_offset != config->gap_offset ||
+           sent->horizontal_offset != config->horizontal_offset || sent->vertical_offset != config->vertical_offset ||
+           sent->darkness != config->darkness || sent->speed != config->speed;
+}
+
+// Find the first and last bytes in which two packed lines differ, returns 0
+// when they are the same
+static int find_changed_span(const unsigned char *line, const unsigned char *old, int width_bytes, int *left, int *right)
+{
+    if (memcmp(line, old, width_bytes) == 0)
+        return 0;
+
+    int l = 0;
+    while (line[l] == old[l])
+        ++l;
+    int r = width_bytes - 1;
+    while (line[r] == old[r])
+        --r;
+
+    *left = l;
+    *right = r;
+    return 1;
+}
+
+// Send a page as the changes to the one before it, left in the printer's
+// image buffer: no CLS, and each changed rectangle overwritten with a mode 0
+// BITMAP. Lines are merged into rectangles the way send_sparse_bitmap does.
+// Returns -1, having sent nothing, when a full page is needed instead: the
+// previous page is unknown or of another size, the setup changed, or the
+// changes are too large.
+int send_differential_page(const unsigned char *mono_data, int width_bytes, int height_pixels, int copies,
+                           print_job_config_t *config)
+{
+    retained_page_t *retained = &config->retained;
+    if (retained->height != height_pixels || retained->width_bytes != width_bytes || page_setup_changed(config))
+        return -1;
+
+    int rects[DIFFERENTIAL_MAX_RECTS][4]; // top, bottom, left, right
+    int count = 0;
+    long bytes = 0;
+    long limit = (long)width_bytes * height_pixels / DIFFERENTIAL_MAX_SHARE;
+    int top = -1, bottom = 0, left = 0, right = 0;
+
+    for (int y = 0; y <= height_pixels; ++y)
+    {
+        int line_left = 0, line_right = 0;
+        int changed = y < height_pixels && find_changed_span(mono_data + (size_t)y * width_bytes,
+                                                             retained->data + (size_t)y * width_bytes, width_bytes,
+                                                             &line_left, &line_right);
+        if (y < height_pixels && !changed)
+            continue;
+
+        if (top >= 0 && changed)
+        {
+            int merged_left = line_left < left ? line_left : left;
+            int merged_right = line_right > right ? line_right : right;
+            long merged = (long)(merged_right - merged_left + 1) * (y - top + 1);
+            long separate = (long)(right - left + 1) * (bottom - top + 1) + SPARSE_BITMAP_OVERHEAD + (line_right - line_left + 1);
+            if (merged <= separate)
+            {
+                bottom = y;
+                left = merged_left;
+                right = merged_right;
+                continue;
+            }
+        }
+
+        // Close the open rectangle
+        if (top >= 0)
+        {
+            if (count == DIFFERENTIAL_MAX_RECTS)
+                return -1;
+            rects[count][0] = top;
+            rects[count][1] = bottom;
+            rects[count][2] = left;
+            rects[count][3] = right;
+            count++;
+            bytes += (long)(right - left + 1) * (bottom - top + 1) + SPARSE_BITMAP_OVERHEAD;
+            if (bytes > limit)
+                return -1;
+        }
+
+        top = bottom = y;
+        left = line_left;
+        right = line_right;
+    }
+
+    wait_for_printer(config);
+    output_stats.page_bytes += (long)width_bytes * height_pixels;
+    for (int i = 0; i < count; ++i)
+    {
+        send_bitmap_rect(mono_data, width_bytes, rects[i][0], rects[i][1], rects[i][2], rects[i][3], 0, i, 0);
+    }
+    fprintf(stderr, "DEBUG: Differential update of %d rectangle%s, %ld bytes.\n", count, count == 1 ? "" : "s", bytes);
+
+    retain_page(retained, mono_data, width_bytes, height_pixels);
+    send_page_trailer(copies);
+    return 0;
+}
+
+// Remember the page now in the printer's image buffer. When there is no
+// memory for it, the next page is sent in full.
+void retain_page(retained_page_t *retained, const unsigned char *mono_data, int width_bytes, int height_pixels)
+{
+    size_t size = (size_t)width_bytes * height_pixels;
+    if (retained->size < size)
+    {
+        free(retained->data);
+        retained->data = malloc(size);
+        retained->size = retained->data ? size : 0;
+    }
+    if (!retained->data)
+    {
+        retained->height = 0;
+        return;
+    }
+
+    memcpy(retained->data, mono_data, size);
+    retained->width_bytes = width_bytes;
+    retained->height = height_pixels;
+}
+
+void retained_page_free(retained_page_t *retained)
+{
+    free(retained->data);
+    memset(retained, 0, sizeof(*retained));
+}
+
+// Open a banded page. Unless the bands go out as BITMAPs of their own, one
+// BITMAP header covers the whole page and the bands follow as its data.
+void begin_band_page(print_job_config_t *config, int width_bytes, int height_pixels)
+{
+    send_page_setup(config);
+    output_stats.page_bytes += (long)width_bytes * height_pixels;
+    if (page_has_bitmap_header(config))
+    {
+        output_printf("BITMAP 0,0,%d,%d,1,", width_bytes, height_pixels);
+    }
+}
+
+// Send one dithered band of a page opened with begin_band_page. Returns the
+// number of BITMAP commands sent for the page so far.
+int send_band(print_job_config_t *config, const unsigned char *mono_data, int width_bytes, int rows, int y, int bitmaps_sent)
+{
+    // The band buffer is refilled once this returns, so it goes out now
+    if (config->sparse_bitmap)
+    {
+        bitmaps_sent = send_sparse_bitmap(mono_data, width_bytes, rows, y, bitmaps_sent);
+        output_flush();
+        return bitmaps_sent;
+    }
+
+    // A complete BITMAP per band, the printer has it all before the next
+    // band is dithered
+    if (config->banded_bitmap)
+    {
+        send_bitmap_rect(mono_data, width_bytes, 0, rows - 1, 0, width_bytes - 1, y, bitmaps_sent++, 1);
+        output_flush();
+        return bitmaps_sent;
+    }
+
+    output_data(mono_data, (size_t)width_bytes * rows);
+    output_stats.bitmap_bytes += (long)width_bytes * rows;
+    output_flush();
+    return bitmaps_sent;
+}
+
+// Send the label setup that precedes the bitmap of a page: whatever changed
+// since the last page, then CLS
+void send_page_setup(print_job_config_t *config)
+{
+    wait_for_printer(config);
+
+    // Some firmware pauses to recalibrate on every SIZE or GAP, so each
+    // command is only repeated when its value changed
+    tspl_state_t *sent = &config->sent;
+    if (!sent->valid || sent->page_width_mm != config->page_width_mm || sent->page_height_mm != config->page_height_mm)
+        output_printf("SIZE %d mm,%d mm\r\n", config->page_width_mm, config->page_height_mm);
+    if (!sent->valid || sent->gap_height != config->gap_height || sent->gap_offset != config->gap_offset)
+        output_printf("GAP %d mm,%d mm\r\n", config->gap_height, config->gap_offset);
+    if (!sent->valid)
+        output_printf("DIRECTION 0,0\r\n");
+    if (!sent->valid || sent->horizontal_offset != config->horizontal_offset || sent->vertical_offset != config->vertical_offset)
+        output_printf("REFERENCE %d,%d\r\n", config->horizontal_offset, config->vertical_offset);
+    if (!sent->valid || sent->darkness != config->darkness)
+        output_printf("DENSITY %d\r\n", config->darkness);
+    if (!sent->valid || sent->speed != config->speed)
+        output_printf("SPEED %d\r\n", config->speed);
+    output_printf("CLS\r\n");
+
+    sent->valid = 1;
+    sent->page_width_mm = config->page_width_mm;
+    sent->page_height_mm = config->page_height_mm;
+    sent->gap_height = config->gap_height;
+    sent->gap_offset = config->gap_offset;
+    sent->horizontal_offset = config->horizontal_offset;
+    sent->vertical_offset = config->vertical_offset;
+    sent->darkness = config->darkness;
+    sent->speed = config->speed;
+}
+
+// Terminate the bitmap data and print the page
+void send_page_trailer(int copies)
+{
+    output_printf("\r\nPRINT 1,%d\r\n", copies);
+    output_flush();
+}
+
+// Seconds to wait for the answer to a status query
+#define STATUS_TIMEOUT 2.0
+
+// Seconds between status queries while the printer is not ready
+#define STATUS_RETRY_INTERVAL 2
+
+// Bits of the TSPL <ESC>!? status byte and the printer-state-reasons they
+// stand for. Printing (0x20) is not listed, the printer buffers the next
+// label while it prints.
+static const struct
+{
+    int bit;
+    const char *reason;
+    const char *message;
+} status_bits[] = {
+    {0x01, "cover-open-error", "Print head is open"},
+    {0x02, "media-jam-error", "Paper jam"},
+    {0x04, "media-empty-error", "Out of labels"},
+    {0x08, "marker-supply-empty-error", "Out of ribbon"},
+    {0x10, "paused", "Printer is paused"},
+    {0x80, "other-error", "Printer error"},
+};
+
+// Ask the printer for its status byte over the back channel. Returns -1 if
+// no answer came.
+int query_printer_status(void)
+{
+    char reply;
+
+    // Drop anything left over from earlier queries
+    while (cupsBackChannelRead(&reply, 1, 0.0) > 0)
+        ;
+
+    output_text("\x1b!?", 3);
+    if (output_flush() < 0)
+        return -1;
+    if (cupsBackChannelRead(&reply, 1, STATUS_TIMEOUT) != 1)
+        return -1;
+    return (unsigned char)reply;
+}
+
+// Report the reasons in 'status' that changed since the last report
+static void report_status_reasons(tspl_state_t *sent, int status)
+{
+    for (size_t i = 0; i < sizeof(status_bits) / sizeof(status_bits[0]); ++i)
+    {
+        int bit = status_bits[i].bit;
+        if ((status & bit) && !(sent->status_reasons & bit))
+        {
+            fprintf(stderr, "STATE: +%s\n", status_bits[i].reason);
+            fprintf(stderr, "INFO: %s, waiting.\n", status_bits[i].message);
+        }
+        else if (!(status & bit) && (sent->status_reasons & bit))
+        {
+            fprintf(stderr, "STATE: -%s\n", status_bits[i].reason);
+        }
+    }
+    sent->status_reasons = status;
+}
+
+// Before a label goes out, hold the job while the printer reports a
+// condition it cannot print through. A printer that does not answer is
+// not asked again for the rest of the job.
+void wait_for_printer(print_job_config_t *config)
+{
+    tspl_state_t *sent = &config->sent;
+    if (!config->status_polling || sent->status_silent)
+        return;
+
+    int blocking = 0;
+    for (size_t i = 0; i < sizeof(status_bits) / sizeof(status_bits[0]); ++i)
+    {
+        blocking |= status_bits[i].bit;
+    }
+
+    for (;;)
+    {
+        int status = query_printer_status();
+        if (status < 0)
+        {
+            fprintf(stderr, "DEBUG: Printer did not answer the status query, not polling it again.\n");
+            report_status_reasons(sent, 0);
+            sent->status_silent = 1;
+            return;
+        }
+
+        int was_waiting = sent->status_reasons != 0;
+        report_status_reasons(sent, status & blocking);
+        if (!(status & blocking))
+        {
+            if (was_waiting)
+                fprintf(stderr, "INFO: Printer is ready, continuing.\n");
+            return;
+        }
+        sleep(STATUS_RETRY_INTERVAL);
+    }
+}
+
+// Load the form index for a printer from the CUPS cache directory. A missing
+// or unreadable index just means no forms are known yet. The index stays
+// locked until form_cache_close(), so two jobs for the same printer cannot
+// both add a form and lose one of them.
+void form_cache_load(form_cache_t *cache, const char *printer_name)
+{
+    const char *cache_dir = getenv("CUPS_CACHEDIR");
+    snprintf(cache->path, sizeof(cache->path), "%s/rw402b-forms-%s.idx", cache_dir ? cache_dir : "/var/cache/cups",
+             printer_name);
+    cache->count = 0;
+    cache->dirty = 0;
+
+    // The index itself is replaced by rename, so the lock lives in a file of
+    // its own that is never replaced
+    char lock_path[1040];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", cache->path);
+    cache->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->lock_fd < 0)
+        fprintf(stderr, "DEBUG: Unable to open form index lock %s.\n", lock_path);
+    else
+        while (flock(cache->lock_fd, LOCK_EX) != 0 && errno == EINTR)
+            ;
+
+    FILE *fp = fopen(cache->path, "r");
+    if (!fp)
+        return;
+
+    char line[256];
+    while (cache->count < FORM_CACHE_MAX && fgets(line, sizeof(line), fp))
+    {
+        form_entry_t *entry = cache->entries + cache->count;
+        unsigned long long hash;
+        if (line[0] == '#' || sscanf(line, "%llx %15s %ld", &hash, entry->name, &entry->last_used) != 3)
+            continue;
+        entry->hash = hash;
+        cache->count++;
+    }
+    fclose(fp);
+}
+
+// Rewrite the form index through a temporary file so a crash never leaves a
+// half written index behind
+void form_cache_save(const form_cache_t *cache)
+{
+    char temp_path[1040];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", cache->path);
+
+    int fd = mkstemp(temp_path);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "DEBUG: Unable to write form index %s.\n", temp_path);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(temp_path);
+        }
+        return;
+    }
+
+    fchmod(fd, 0644);
+    fprintf(fp, "# rastertorw402b stored forms: hash name last-used\n");
+    for (int i = 0; i < cache->count; ++i)
+    {
+        const form_entry_t *entry = cache->entries + i;
+        fprintf(fp, "%016llx %s %ld\n", (unsigned long long)entry->hash, entry->name, entry->last_used);
+    }
+    if (fclose(fp) != 0 || rename(temp_path, cache->path) != 0)
+    {
+        fprintf(stderr, "DEBUG: Unable to replace form index %s.\n", cache->path);
+        unlink(temp_path);
+    }
+}
+
+// Write the last-used times of the job and release the form index lock
+void form_cache_close(form_cache_t *cache)
+{
+    if (cache->dirty)
+        form_cache_save(cache);
+    cache->dirty = 0;
+    if (cache->lock_fd >= 0)
+        close(cache->lock_fd);
+    cache->lock_fd = -1;
+}
+
+// Upload a packed layer as a 1-bit BMP into printer flash
+static int download_form(const unsigned char *layer, int width_bytes, int height_pixels, const char *name)
+{
+    int stride = (width_bytes + 3) & ~3;
+    unsigned image_size = (unsigned)stride * height_pixels;
+    unsigned file_size = 62 + image_size;
+    unsigned char *bmp = calloc(1, file_size);
+    if (!bmp)
+        return -1;
+
+    // File header, BITMAPINFOHEADER and a black/white palette. Palette index 1
+    // is white, matching the bit sense of the packed data.
+    unsigned width_pixels = width_bytes * 8;
+    unsigned char *h = bmp;
+    h[0] = 'B';
+    h[1] = 'M';
+    for (int i = 0; i < 4; ++i)
+    {
+        h[2 + i] = (unsigned char)(file_size >> (8 * i));
+        h[10 + i] = (unsigned char)(62 >> (8 * i));
+        h[14 + i] = (unsigned char)(40 >> (8 * i));
+        h[18 + i] = (unsigned char)(width_pixels >> (8 * i));
+        h[22 + i] = (unsigned char)((unsigned)height_pixels >> (8 * i));
+        h[34 + i] = (unsigned char)(image_size >> (8 * i));
+        h[38 + i] = (unsigned char)(8000 >> (8 * i)); // 203 dpi in pixels per metre
+        h[42 + i] = (unsigned char)(8000 >> (8 * i));
+        h[46 + i] = (unsigned char)(2 >> (8 * i));
+        h[50 + i] = (unsigned char)(2 >> (8 * i));
+    }
+    h[26] = 1; // Planes
+    h[28] = 1; // Bits per pixel
+    memset(h + 58, 0xFF, 3);
+
+    // BMP rows run bottom to top, padded to 4 bytes with white
+    for (int y = 0; y < height_pixels; ++y)
+    {
+        unsigned char *row = bmp + 62 + (size_t)(height_pixels - 1 - y) * stride;
+        memcpy(row, layer + (size_t)y * width_bytes, width_bytes);
+        memset(row + width_bytes, 0xFF, stride - width_bytes);
+    }
+
+    output_printf("DOWNLOAD F,\"%s\",%u,", name, file_size);
+    output_data(bmp, file_size);
+    output_stats.bitmap_bytes += file_size;
+    output_printf("\r\n");
+
+    // A form that may not have reached the printer must not be recalled later
+    int result = output_flush();
+    free(bmp);
+    return result;
+}
+
+// Name a new form after its hash. File names only have room for 28 bits of
+// it, so when another entry already uses the name the next free one is
+// taken, and two layers never share a file in flash. 'form' is the entry
+// being filled, its old name is free to reuse.
+static void form_pick_name(const form_cache_t *cache, form_entry_t *form, uint64_t hash)
+{
+    for (unsigned number = (unsigned)(hash & 0xFFFFFFF);; number = (number + 1) & 0xFFFFFFF)
+    {
+        char name[sizeof(form->name)];
+        snprintf(name, sizeof(name), "F%07X.BMP", number);
+
+        int used = 0;
+        for (int i = 0; i < cache->count && !used; ++i)
+        {
+            used = cache->entries + i != form && strcmp(cache->entries[i].name, name) == 0;
+        }
+        if (!used)
+        {
+            memcpy(form->name, name, sizeof(name));
+            return;
+        }
+    }
+}
+
+// Send a page as its static layer, recalled from printer flash, plus the
+// variable area as a bitmap. The layer is uploaded first if the index does not
+// list it yet, evicting the least recently used form when flash is full.
+// Returns -1 if the page should be sent as a plain bitmap instead, which is
+// always the case when FormVariableArea is not set.
+int send_form_page(const unsigned char *mono_data, int width_bytes, int height_pixels, int copies, print_job_config_t *config)
+{
+    form_cache_t *cache = config->forms;
+
+    // Variable area in whole bytes, clipped to the page
+    int left = config->form_area[0] / 8;
+    int right = (config->form_area[0] + config->form_area[2] + 7) / 8 - 1;
+    int top = config->form_area[1];
+    int bottom = config->form_area[1] + config->form_area[3] - 1;
+    if (left < 0)
+        left = 0;
+    if (right >= width_bytes)
+        right = width_bytes - 1;
+    if (top < 0)
+        top = 0;
+    if (bottom >= height_pixels)
+        bottom = height_pixels - 1;
+    int has_area = config->form_area[2] > 0 && config->form_area[3] > 0 && left <= right && top <= bottom;
+
+    // Without a variable area every new label would be a new form, uploaded
+    // in full and wearing flash for nothing
+    if (!has_area)
+        return -1;
+
+    size_t page_size = (size_t)width_bytes * height_pixels;
+    unsigned char *layer = malloc(page_size);
+    if (!layer)
+        return -1;
+
+    memcpy(layer, mono_data, page_size);
+    for (int y = top; y <= bottom; ++y)
+    {
+        memset(layer + (size_t)y * width_bytes + left, 0xFF, right - left + 1);
+    }
+
+    uint64_t hash = page_hash(layer, page_size) ^ ((uint64_t)width_bytes << 48) ^ (uint64_t)height_pixels;
+    form_entry_t *form = NULL;
+    for (int i = 0; i < cache->count; ++i)
+    {
+        if (cache->entries[i].hash == hash)
+            form = cache->entries + i;
+    }
+
+    if (!form)
+    {
+        if (cache->count == FORM_CACHE_MAX)
+        {
+            form = cache->entries;
+            for (int i = 1; i < cache->count; ++i)
+            {
+                if (cache->entries[i].last_used < form->last_used)
+                    form = cache->entries + i;
+            }
+            output_printf("KILL F,\"%s\"\r\n", form->name);
+        }
+        else
+        {
+            form = cache->entries + cache->count++;
+        }
+
+        form->hash = hash;
+        form_pick_name(cache, form, hash);
+        if (download_form(layer, width_bytes, height_pixels, form->name) < 0)
+        {
+            // Drop the half made entry, the page goes out as a plain bitmap.
+            // The index is rewritten, an evicted form is gone either way.
+            *form = cache->entries[--cache->count];
+            form_cache_save(cache);
+            free(layer);
+            return -1;
+        }
+        fprintf(stderr, "DEBUG: Stored form %s in printer flash.\n", form->name);
+        form->last_used = (long)time(NULL);
+        form_cache_save(cache);
+    }
+    else
+    {
+        // Only the eviction order changes, written once at the end of the job
+        form->last_used = (long)time(NULL);
+        cache->dirty = 1;
+    }
+    free(layer);
+
+    send_page_setup(config);
+    output_stats.page_bytes += (long)page_size;
+    output_printf("PUTBMP 0,0,\"%s\"\r\n", form->name);
+    send_bitmap_rect(mono_data, width_bytes, top, bottom, left, right, 0, 0, 1);
+    send_page_trailer(copies);
+    return 0;
+}
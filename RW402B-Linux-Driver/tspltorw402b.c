@@ -0,0 +1,326 @@
+/******************************************************************************
+ *
+ * Munbyn RW402B CUPS TSPL Template Filter
+ *
+ * Turns a TSPL label template into printer commands without rasterizing.
+ * The template holds the body of a label (TEXT, BARCODE, QRCODE, BOX, ...)
+ * with ${name} placeholders. Values follow the template in the same job
+ * file, after a line holding only "---", one label per block of name=value
+ * lines.
+ * The SIZE/GAP/DENSITY/SPEED preamble and PRINT are the raster filter's.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ ******************************************************************************/
+
+#define RW402B_NO_MAIN
+#include "rastertorw402b.c"
+
+// Largest template file accepted, variables included
+#define TEMPLATE_MAX_SIZE (1024 * 1024)
+
+// Line between the template and its variables
+#define TEMPLATE_SEPARATOR "---"
+
+// Variables of one label
+#define TEMPLATE_MAX_VARIABLES 64
+
+typedef struct template_variable_s
+{
+    char name[64];
+    char *value; // Points into the job file
+} template_variable_t;
+
+typedef struct template_label_s
+{
+    int count;
+    template_variable_t variables[TEMPLATE_MAX_VARIABLES];
+} template_label_t;
+
+// Function Prototypes
+char *read_whole_file(int fd, size_t *length);
+char *split_template_variables(char *text);
+char *next_label_variables(char *cursor, template_label_t *label);
+void send_template_label(const char *template_text, const template_label_t *label, print_job_config_t *config);
+
+int main(int argc, char *argv[])
+{
+    if (argc < 6 || argc > 7)
+    {
+        fprintf(stderr, "ERROR: tspltorw402b job-id user title copies options [file]\n");
+        return 1;
+    }
+
+    print_job_config_t config = {0};
+    config.job_id = atoi(argv[1]);
+    config.user = argv[2];
+    config.title = argv[3];
+    config.copies = atoi(argv[4]);
+    set_default_options(&config);
+
+    cups_option_t *options = NULL;
+    int num_options = cupsParseOptions(argv[5], 0, &options);
+
+    const char *printer_name = getenv("PRINTER");
+    char ppd_path[1024];
+    if (printer_name)
+    {
+        snprintf(ppd_path, sizeof(ppd_path), "/etc/cups/ppd/%s.ppd", printer_name);
+        set_pstops_options(&config, num_options, options, ppd_path);
+    }
+    else
+    {
+        set_pstops_options(&config, num_options, options, NULL);
+    }
+
+    int fd = 0; // Default to stdin
+    if (argc == 7)
+    {
+        fd = open(argv[6], O_RDONLY);
+        if (fd < 0)
+        {
+            perror("ERROR: Unable to open template file");
+            cupsFreeOptions(num_options, options);
+            return 1;
+        }
+    }
+
+    size_t length;
+    char *template_text = read_whole_file(fd, &length);
+    if (fd != 0)
+        close(fd);
+    if (!template_text)
+    {
+        fprintf(stderr, "ERROR: Unable to read the label template.\n");
+        cupsFreeOptions(num_options, options);
+        return 1;
+    }
+
+    // Filters run as the lp user, so values are never read from a path the
+    // submitter names. Printing the bare template instead would waste labels.
+    if (cupsGetOption("TemplateVariables", num_options, options))
+    {
+        fprintf(stderr, "ERROR: TemplateVariables is not supported, put the values after a \"" TEMPLATE_SEPARATOR
+                        "\" line in the template.\n");
+        free(template_text);
+        cupsFreeOptions(num_options, options);
+        return 1;
+    }
+    char *variables = split_template_variables(template_text);
+
+    template_label_t label;
+    int labels = 0;
+    if (!variables)
+    {
+        // No variables, the template is printed as it is
+        label.count = 0;
+        send_template_label(template_text, &label, &config);
+        labels = 1;
+    }
+    else
+    {
+        char *cursor = variables;
+        while ((cursor = next_label_variables(cursor, &label)) != NULL)
+        {
+            send_template_label(template_text, &label, &config);
+            labels++;
+        }
+    }
+    fprintf(stderr, "DEBUG: Sent %d template label%s.\n", labels, labels == 1 ? "" : "s");
+
+    free(template_text);
+    cupsFreeOptions(num_options, options);
+    return 0;
+}
+
+// Read all of 'fd' into a NUL-terminated buffer
+char *read_whole_file(int fd, size_t *length)
+{
+    size_t size = 4096;
+    size_t used = 0;
+    char *data = malloc(size);
+    if (!data)
+        return NULL;
+
+    for (;;)
+    {
+        if (used + 1 == size)
+        {
+            if (size >= TEMPLATE_MAX_SIZE)
+            {
+                fprintf(stderr, "ERROR: Template input is larger than %d bytes.\n", TEMPLATE_MAX_SIZE);
+                free(data);
+                return NULL;
+            }
+            char *grown = realloc(data, size * 2);
+            if (!grown)
+            {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            size *= 2;
+        }
+
+        ssize_t got = read(fd, data + used, size - used - 1);
+        if (got < 0)
+        {
+            free(data);
+            return NULL;
+        }
+        if (got == 0)
+            break;
+        used += got;
+    }
+
+    data[used] = '\0';
+    *length = used;
+    return data;
+}
+
+// Cut 'text' at the separator line. Returns the variables that follow it,
+// or NULL when the job is a template alone.
+char *split_template_variables(char *text)
+{
+    char *line = text;
+    while (*line)
+    {
+        size_t length = strcspn(line, "\n");
+        size_t content = length > 0 && line[length - 1] == '\r' ? length - 1 : length;
+        if (content == strlen(TEMPLATE_SEPARATOR) && strncmp(line, TEMPLATE_SEPARATOR, content) == 0)
+        {
+            char *variables = line[length] ? line + length + 1 : line + length;
+            *line = '\0';
+            return variables;
+        }
+        line += line[length] ? length + 1 : length;
+    }
+    return NULL;
+}
+
+// Parse the next block of name=value lines into 'label', splitting the
+// buffer in place. Blocks are separated by blank lines and '#' starts a
+// comment line. Returns where the following block starts, or NULL when
+// there are no more labels.
+char *next_label_variables(char *cursor, template_label_t *label)
+{
+    label->count = 0;
+
+    while (*cursor)
+    {
+        char *line = cursor;
+        char *end = strchr(line, '\n');
+        cursor = end ? end + 1 : line + strlen(line);
+        if (end)
+            *end = '\0';
+        if (end && end > line && end[-1] == '\r')
+            end[-1] = '\0';
+
+        if (line[0] == '\0')
+        {
+            if (label->count > 0)
+                return cursor;
+            continue;
+        }
+        if (line[0] == '#')
+            continue;
+
+        char *equals = strchr(line, '=');
+        if (!equals || equals == line)
+        {
+            fprintf(stderr, "DEBUG: Ignoring template variable line \"%s\".\n", line);
+            continue;
+        }
+        if (label->count == TEMPLATE_MAX_VARIABLES)
+        {
+            fprintf(stderr, "DEBUG: More than %d variables for one label, ignoring \"%s\".\n", TEMPLATE_MAX_VARIABLES, line);
+            continue;
+        }
+
+        template_variable_t *variable = label->variables + label->count++;
+        *equals = '\0';
+        snprintf(variable->name, sizeof(variable->name), "%s", line);
+        variable->value = equals + 1;
+    }
+
+    return label->count > 0 ? cursor : NULL;
+}
+
+// Queue template text, ending bare LF lines with CR LF as the printer
+// expects. The text itself is not copied.
+static void put_template_text(const char *text, size_t length)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (text[i] == '\n' && (i == 0 || text[i - 1] != '\r'))
+        {
+            output_data(text + start, i - start);
+            output_text("\r", 1);
+            start = i;
+        }
+    }
+    output_data(text + start, length - start);
+}
+
+static const char *find_variable(const template_label_t *label, const char *name, size_t name_length)
+{
+    for (int i = 0; i < label->count; ++i)
+    {
+        if (strlen(label->variables[i].name) == name_length && strncmp(label->variables[i].name, name, name_length) == 0)
+            return label->variables[i].value;
+    }
+    return NULL;
+}
+
+// Send one label: the usual preamble, the template with every ${name}
+// replaced, then PRINT. Quotes in values are escaped the TSPL way, \["],
+// so a value cannot end the string it is placed in.
+void send_template_label(const char *template_text, const template_label_t *label, print_job_config_t *config)
+{
+    send_page_setup(config);
+
+    const char *p = template_text;
+    while (*p)
+    {
+        const char *start = strstr(p, "${");
+        const char *close = start ? strchr(start + 2, '}') : NULL;
+        if (!close)
+        {
+            put_template_text(p, strlen(p));
+            break;
+        }
+
+        put_template_text(p, start - p);
+        const char *name = start + 2;
+        size_t name_length = close - name;
+        const char *value = find_variable(label, name, name_length);
+        if (!value)
+            fprintf(stderr, "DEBUG: Template variable %.*s is not set.\n", (int)name_length, name);
+
+        while (value && *value)
+        {
+            size_t plain = strcspn(value, "\"");
+            output_data(value, plain);
+            value += plain;
+            if (*value == '"')
+            {
+                output_text("\\[\"]", 4);
+                value++;
+            }
+        }
+        p = close + 1;
+    }
+
+    send_page_trailer(config->copies);
+}